@@ -0,0 +1,129 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <set>
+#include <sstream>
+#include <vector>
+
+#include "unittool.hpp"
+
+class blame : public tool {
+	public:
+		blame(void) = default;
+
+		virtual string name (void) override { return "blame"; }
+		virtual string descr(void) override { return "show the dependency chain that dominated the last start of a unit"; }
+		virtual string usage(void) override { return "unittool blame [unit]"; }
+		virtual ~blame(void) = default;
+
+		virtual void main(int argc, char** argv) override;
+
+	private:
+		struct entry {
+			uint64_t queued;
+			uint64_t startable;
+			uint64_t started;
+			uint64_t ready;
+			string   blocker;
+		};
+
+		static string secs(uint64_t ns);
+		static uint64_t span(uint64_t from, uint64_t to) { return to > from ? to - from : 0; }
+};
+
+string blame::secs(uint64_t ns) {
+	char buf[32];
+	snprintf(buf, sizeof(buf), "%.3fs", ns / 1e9);
+	return buf;
+}
+
+void blame::main(int argc, char** argv) {
+	if (argc > 3) {
+		cerr << "usage: " << usage() << endl;
+		exit(1);
+	}
+
+	char* statedir = getenv("WSUNIT_STATE_DIR");
+	if (!statedir) {
+		cerr << "WSUNIT_STATE_DIR environment variable is not set" << endl;
+		exit(1);
+	}
+
+	ifstream in(string(statedir) + "/timing");
+	if (!in) {
+		cerr << "could not open " << statedir << "/timing" << endl;
+		exit(1);
+	}
+
+	string phase = "default";
+	uint64_t base = 0;
+	map<string, entry> units;
+
+	string line;
+	while (getline(in, line)) {
+		vector<string> f;
+		stringstream ss(line);
+		string field;
+		while (getline(ss, field, '\t')) f.push_back(field);
+
+		if (f.size() >= 2 && f[0] == "phase")
+			phase = f[1];
+		else if (f.size() >= 2 && f[0] == "daemon")
+			base = stoull(f[1]);
+		else if (f.size() >= 6 && f[0] == "unit")
+			units[f[1]] = entry{ stoull(f[2]), stoull(f[3]), stoull(f[4]), stoull(f[5]), f.size() >= 7 ? f[6] : "" };
+	}
+
+	string root = argc == 3 ? argv[2] : "@" + phase;
+	if (units.count(root) == 0) {
+		cerr << "unknown unit: " << root << endl;
+		exit(1);
+	}
+
+	if (!units.at(root).ready) {
+		cerr << root << " has not become ready yet" << endl;
+		exit(1);
+	}
+
+	vector<string> chain;
+	set<string> seen;
+	for (string n = root; !n.empty() && units.count(n) && !seen.count(n); n = units.at(n).blocker) {
+		chain.push_back(n);
+		seen.insert(n);
+	}
+	reverse(chain.begin(), chain.end());
+
+	cout << "critical path to " << root << ", ready " << secs(span(base, units.at(root).ready)) << " after wsunitd start:" << endl;
+	cout << endl;
+	printf("  %10s %10s %10s  %s\n", "startable", "waiting", "running", "unit");
+	for (auto& n : chain) {
+		auto& e = units.at(n);
+		printf("  %10s %10s %10s  %s\n",
+			("+" + secs(span(base, e.startable))).c_str(),
+			secs(span(e.startable, e.started)).c_str(),
+			secs(span(e.started  , e.ready  )).c_str(),
+			n.c_str()
+		);
+	}
+
+	vector<string> ranked = chain;
+	sort(ranked.begin(), ranked.end(), [&units](const string& a, const string& b) {
+		auto& ea = units.at(a);
+		auto& eb = units.at(b);
+		return span(ea.startable, ea.ready) > span(eb.startable, eb.ready);
+	});
+
+	cout << endl;
+	cout << "ranked by time spent on the critical path:" << endl;
+	cout << endl;
+	int i = 0;
+	for (auto& n : ranked) {
+		auto& e = units.at(n);
+		printf("  %3d. %s: %s waiting, %s running\n", ++i, n.c_str(), secs(span(e.startable, e.started)).c_str(), secs(span(e.started, e.ready)).c_str());
+	}
+}
+
+void add_blame(void) { tool::add(make_shared<blame>()); }
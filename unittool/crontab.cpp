@@ -0,0 +1,130 @@
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
+
+#include "scheduler.hpp"
+#include "unittool.hpp"
+
+using namespace std;
+
+class crontab : public tool {
+	public:
+		crontab(void) = default;
+
+		virtual string name (void) override { return "crontab"; }
+		virtual string descr(void) override { return "execute the commands of a crontab-style file whenever their time pattern matches"; }
+		virtual string usage(void) override { return "unittool crontab <file>"; }
+		virtual ~crontab(void) = default;
+
+		virtual void main(int argc, char** argv) override;
+
+	private:
+		string                file;
+		shared_ptr<scheduler> sched;
+
+		void load(void);
+};
+
+// File format: one job per line, `<min> <hour> <day> <month> <weekday> [@skip|@queue|@allow] <command>`, with the
+// time pattern syntax of cronexec. The command is run by /bin/sh. If a job is still running when it is due again,
+// @skip (the default) drops the run, @queue runs it once the previous run exited and @allow runs it concurrently.
+// Empty lines and lines starting with `#` are ignored.
+
+void crontab::load(void) {
+	ifstream in(file);
+	if (!in) {
+		cerr << "could not open " << file << ", keeping " << sched->get_jobs().size() << " jobs" << endl;
+		return;
+	}
+
+	// jobs whose line did not change keep their state, so running instances are still accounted for; identical lines
+	// are separate jobs, each line takes over at most one old job
+	multimap<string, shared_ptr<scheduler::job>> old;
+	for (auto& j : sched->get_jobs()) old.emplace(j->line, j);
+
+	vector<shared_ptr<scheduler::job>> loaded;
+	string line;
+	for (unsigned nr = 1; getline(in, line); ++nr) {
+		size_t b = line.find_first_not_of(" \t");
+		if (b == string::npos || line[b] == '#') continue;
+
+		auto it = old.find(line);
+		if (it != old.end()) {
+			loaded.push_back(it->second);
+			old.erase(it);
+			continue;
+		}
+
+		istringstream ss(line);
+		string f[5];
+		ss >> f[0] >> f[1] >> f[2] >> f[3] >> f[4];
+
+		auto j = make_shared<scheduler::job>();
+		j->line = line;
+
+		string command;
+		getline(ss >> ws, command);
+		if (!command.empty() && command[0] == '@') {
+			size_t e = command.find_first_of(" \t");
+			string p = command.substr(0, e);
+
+			if (!scheduler::parse_policy(p, j->policy)) {
+				cerr << file << ":" << nr << ": unknown policy " << p << ", ignoring" << endl;
+				continue;
+			}
+
+			e = command.find_first_not_of(" \t", e);
+			command = e == string::npos ? "" : command.substr(e);
+		}
+
+		if (command.empty()) {
+			cerr << file << ":" << nr << ": missing command, ignoring" << endl;
+			continue;
+		}
+
+		try {
+			j->sched = make_shared<schedule>(f[0], f[1], f[2], f[3], f[4]);
+		}
+		catch (exception& ex) {
+			cerr << file << ":" << nr << ": " << ex.what() << ", ignoring" << endl;
+			continue;
+		}
+
+		j->name = "\"" + command + "\"";
+		j->argv = { "/bin/sh", "-c", command };
+		loaded.push_back(j);
+	}
+
+	sched->set_jobs(loaded);
+	cerr << "loaded " << loaded.size() << " jobs from " << file << endl;
+}
+
+void crontab::main(int argc, char** argv) {
+	if (argc != 3) {
+		cerr << "usage: " << usage() << endl;
+		exit(1);
+	}
+
+	file = argv[2];
+
+	try {
+		sched = make_shared<scheduler>();
+	}
+	catch (exception& ex) {
+		cerr << ex.what() << endl;
+		exit(1);
+	}
+
+	if (!ifstream(file)) {
+		cerr << "could not open " << file << endl;
+		exit(1);
+	}
+
+	sched->watch(file, [this]{ load(); });
+	load();
+	sched->run();
+}
+
+void add_crontab(void) { tool::add(make_shared<crontab>()); }
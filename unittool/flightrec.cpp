@@ -0,0 +1,138 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <signal.h>
+#include <sys/wait.h>
+#include <vector>
+
+#include "unittool.hpp"
+#include "../wsunitd/flightrec.hpp"
+
+class flightrec : public tool {
+	public:
+		flightrec(void) = default;
+
+		virtual string name (void) override { return "flightrec"; }
+		virtual string descr(void) override { return "decode a flight recorder dump of wsunitd"; }
+		virtual string usage(void) override { return "unittool flightrec [file]"; }
+		virtual ~flightrec(void) = default;
+
+		virtual void main(int argc, char** argv) override;
+
+	private:
+		static string signal_string(int signum);
+		static string state_name   (uint8_t state);
+		static string state_descr  (uint8_t state);
+		static string render(const flightrec_record& r, const vector<string>& names);
+};
+
+string flightrec::signal_string(int signum) {
+	#if !defined(__GLIBC__)
+		return to_string(signum);
+	#elif __GLIBC__ == 2 && __GLIBC_MINOR__ < 32
+		return string("SIG") + sys_siglist[signum] + " (" + to_string(signum) + ")";
+	#else
+		return string("SIG") + sigabbrev_np(signum) + " (" + to_string(signum) + ")";
+	#endif
+}
+
+string flightrec::state_name(uint8_t state) {
+	return state < sizeof(flightrec_states) / sizeof(*flightrec_states) ? flightrec_states[state] : "?";
+}
+
+string flightrec::state_descr(uint8_t state) {
+	string s = state_name(state);
+	if (s == "UP"  ) return "ready"  ;
+	if (s == "DOWN") return "down"   ;
+	return "running";
+}
+
+string flightrec::render(const flightrec_record& r, const vector<string>& names) {
+	auto name = [&names](uint32_t i) { return i < names.size() ? names[i] : string("?"); };
+
+	switch (r.type) {
+		case FR_STATE: {
+			string s = state_descr(r.a) + " -> " + state_descr(r.b);
+			return name(r.unit) + ": " + s + " (" + state_name(r.a) + " -> " + state_name(r.b) + ")";
+		}
+
+		case FR_QUEUE: {
+			string q = r.a == 0 ? "start" : "stop";
+			string reason = reason_text((reason_code) r.b, name(r.other));
+			if (r.keep) return "keep unit " + name(r.unit) + " in "   + q + " queue: " + reason;
+			else        return "drop unit " + name(r.unit) + " from " + q + " queue: " + reason;
+		}
+
+		case FR_SPAWN:
+			return name(r.unit) + ": exec " + script_kind_name((script_kind) r.a) + " script (pid " + to_string(r.pid) + ")";
+
+		case FR_EXIT: {
+			string s = name(r.unit) + ": " + script_kind_name((script_kind) r.a) + " script";
+			if (WIFEXITED(r.value))
+				s += " exited with code " + to_string(WEXITSTATUS(r.value));
+			else if (WIFSIGNALED(r.value))
+				s += " terminated by signal " + signal_string(WTERMSIG(r.value));
+			return s + " (pid " + to_string(r.pid) + ")";
+		}
+
+		case FR_SIGNAL:
+			return "received " + signal_string(r.value);
+	}
+
+	return "unknown record type " + to_string(r.type);
+}
+
+void flightrec::main(int argc, char** argv) {
+	if (argc > 3) {
+		cerr << "usage: " << usage() << endl;
+		exit(1);
+	}
+
+	string file;
+	if (argc == 3)
+		file = argv[2];
+	else {
+		char* statedir = getenv("WSUNIT_STATE_DIR");
+		if (!statedir) {
+			cerr << "WSUNIT_STATE_DIR environment variable is not set" << endl;
+			exit(1);
+		}
+		file = string(statedir) + "/flightrec";
+	}
+
+	ifstream in(file, ios::binary);
+	if (!in) {
+		cerr << "could not open " << file << endl;
+		exit(1);
+	}
+
+	flightrec_header h;
+	if (!in.read((char*) &h, sizeof(h)) || h.magic != flightrec_magic || h.version != flightrec_version) {
+		cerr << file << ": not a flight recorder dump of a compatible version" << endl;
+		exit(1);
+	}
+
+	vector<string> names;
+	for (uint32_t i = 0; i < h.names; ++i) {
+		uint16_t l;
+		in.read((char*) &l, sizeof(l));
+		string s(l, '\0');
+		in.read(&s[0], l);
+		names.push_back(s);
+	}
+
+	for (uint32_t i = 0; i < h.records; ++i) {
+		flightrec_record r;
+		if (!in.read((char*) &r, sizeof(r))) {
+			cerr << file << ": truncated after " << i << " records" << endl;
+			exit(1);
+		}
+
+		double t = ((double) r.time - (double) h.started) / 1e9;
+		printf("[%12.6f] %s\n", t, render(r, names).c_str());
+	}
+}
+
+void add_flightrec(void) { tool::add(make_shared<flightrec>()); }
@@ -0,0 +1,144 @@
+#include "schedule.hpp"
+
+#include <random>
+#include <stdexcept>
+
+#include <boost/regex.hpp>
+
+using namespace std;
+using namespace boost;
+
+// Every field is compiled into a bitset over the values 0 to 63. The month field is matched against 0 to 11 and a
+// weekday of 7 is folded into 0, as with the original matcher.
+
+schedule::schedule(const string& min, const string& hour, const string& day, const string& mon, const string& wday) :
+	min(parse(min)), hour(parse(hour)), day(parse(day)), mon(parse(mon)), wday(parse(wday)), src(min + " " + hour + " " + day + " " + mon + " " + wday) {
+	if (this->wday & (1ULL << 7)) this->wday |= 1;
+}
+
+string schedule::str(void) const { return src; }
+
+bool schedule::matches(time_t t) const {
+	struct tm tm;
+	localtime_r(&t, &tm);
+	return (min  >> tm.tm_min  & 1)
+	    && (hour >> tm.tm_hour & 1)
+	    && (day  >> tm.tm_mday & 1)
+	    && (mon  >> tm.tm_mon  & 1)
+	    && (wday >> tm.tm_wday & 1);
+}
+
+time_t schedule::next(time_t after) const {
+	struct tm tm;
+	localtime_r(&after, &tm);
+	tm.tm_sec = 0;
+	tm.tm_min++;
+	tm.tm_isdst = -1;
+
+	// every carry moves forward by at least a minute, and a month without a match is skipped as a whole
+	for (int i = 0; i < 10000; ++i) {
+		time_t t = mktime(&tm);
+		if (t == -1) return -1;
+		tm.tm_isdst = -1;
+
+		if (!(mon >> tm.tm_mon & 1)) {
+			tm.tm_mon++;
+			tm.tm_mday = 1;
+			tm.tm_hour = 0;
+			tm.tm_min  = 0;
+			continue;
+		}
+
+		if (!(day >> tm.tm_mday & 1) || !(wday >> tm.tm_wday & 1)) {
+			tm.tm_mday++;
+			tm.tm_hour = 0;
+			tm.tm_min  = 0;
+			continue;
+		}
+
+		int h = first_from(hour, tm.tm_hour);
+		if (h != tm.tm_hour) {
+			if (h < 0) tm.tm_mday++, h = 0;
+			tm.tm_hour = h;
+			tm.tm_min  = 0;
+			continue;
+		}
+
+		int m = first_from(min, tm.tm_min);
+		if (m != tm.tm_min) {
+			if (m < 0) tm.tm_hour++, m = 0;
+			tm.tm_min = m;
+			continue;
+		}
+
+		if (t > after) return t;
+		tm.tm_min++;
+	}
+
+	return -1;
+}
+
+int schedule::first_from(uint64_t bits, int from) {
+	bits &= ~0ULL << from;
+	return bits ? __builtin_ctzll(bits) : -1;
+}
+
+uint64_t schedule::range(int min, int max) {
+	if (min < 0) min = 0;
+	if (max > 63) max = 63;
+	if (min > max) return 0;
+	return (~0ULL >> (63 - max)) & (~0ULL << min);
+}
+
+uint64_t schedule::parse_prim(const string& in) {
+	static regex reAny   (R"(^\*$)"                );
+	static regex reNumber(R"(^[0-9]+$)"            );
+	static regex reRange (R"(^([0-9]+)\-([0-9]+)$)");
+	static regex reRand  (R"(^([0-9]+)~([0-9]+)$)" );
+	static mt19937 mt(time(0));
+	smatch res;
+
+	if (regex_match(in, res, reAny))
+		return ~0ULL;
+
+	if (regex_match(in, res, reNumber))
+		return range(stoi(res[0]), stoi(res[0]));
+
+	if (regex_match(in, res, reRange))
+		return range(stoi(res[1]), stoi(res[2]));
+
+	if (regex_match(in, res, reRand)) {
+		int a = stoi(res[1]), b = stoi(res[2]);
+		if (a > b) return 0;
+		int n = uniform_int_distribution<int>(a, b)(mt);
+		return range(n, n);
+	}
+
+	throw runtime_error("could not parse: " + in);
+}
+
+uint64_t schedule::parse_step(const string& in) {
+	static regex reStep(R"(^(.*)/([0-9]+)$)");
+	smatch res;
+
+	if (regex_match(in, res, reStep)) {
+		int step = stoi(res[2]);
+		if (step == 0) throw runtime_error("could not parse: " + in);
+
+		uint64_t steps = 0;
+		for (int i = 0; i < 64; i += step) steps |= 1ULL << i;
+		return parse_prim(res[1]) & steps;
+	}
+
+	return parse_prim(in);
+}
+
+uint64_t schedule::parse(const string& in) {
+	static regex reEither(R"(^([^,]+),(.+)$)");
+	smatch res;
+
+	if (regex_match(in, res, reEither))
+		return parse_step(res[1]) | parse(res[2]);
+
+	return parse_step(in);
+}
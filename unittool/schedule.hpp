@@ -0,0 +1,28 @@
+#pragma once
+
+// Cron-style time patterns, shared by cronexec and wsunitd.
+
+#include <cstdint>
+#include <ctime>
+#include <string>
+
+class schedule {
+	public:
+		// Each field is a comma separated list of `*`, `<n>`, `<a>-<b>` or `<a>~<b>` (a random value in the range,
+		// rolled once), each optionally followed by `/<step>`. Throws runtime_error if a field cannot be parsed.
+		schedule(const std::string& min, const std::string& hour, const std::string& day, const std::string& mon, const std::string& wday);
+
+		bool   matches(time_t t) const;
+		time_t next   (time_t after) const; // start of the first matching minute after `after`, or -1 if there is none
+		std::string str(void) const;
+
+	private:
+		uint64_t min, hour, day, mon, wday;
+		std::string src;
+
+		static uint64_t parse      (const std::string& in);
+		static uint64_t parse_step (const std::string& in);
+		static uint64_t parse_prim (const std::string& in);
+		static uint64_t range      (int min, int max);
+		static int      first_from (uint64_t bits, int from);
+};
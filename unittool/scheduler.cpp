@@ -0,0 +1,255 @@
+#include "scheduler.hpp"
+
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/poll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+bool scheduler::parse_policy(const string& s, policy_t& p) {
+	if (s == "@skip" ) { p = SKIP ; return true; }
+	if (s == "@queue") { p = QUEUE; return true; }
+	if (s == "@allow") { p = ALLOW; return true; }
+	return false;
+}
+
+scheduler::scheduler(void) : ifd(-1) {
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &mask, &oldmask);
+
+	sfd = signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+	if (sfd == -1) throw runtime_error(string("could not create signalfd: ") + strerror(errno));
+
+	tfd = timerfd_create(CLOCK_REALTIME, TFD_CLOEXEC | TFD_NONBLOCK);
+	if (tfd == -1) throw runtime_error(string("could not create timerfd: ") + strerror(errno));
+
+	char* s = getenv("WSUNIT_CRON_STATS");
+	if (s && *s) stats = s;
+}
+
+void scheduler::set_jobs(const vector<shared_ptr<job>>& jobs) {
+	this->jobs = jobs;
+	plan();
+	report();
+}
+
+const vector<shared_ptr<scheduler::job>>& scheduler::get_jobs(void) { return jobs; }
+
+void scheduler::watch(const string& file, function<void(void)> on_change) {
+	ifd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+	if (ifd == -1) {
+		cerr << "could not create inotify instance, changes to " << file << " will not be picked up: " << strerror(errno) << endl;
+		return;
+	}
+
+	// watch the directory, editors tend to replace the file instead of writing to it
+	string dir = file.find('/') == string::npos ? "." : file.substr(0, file.rfind('/') + 1);
+	watched         = file.substr(file.rfind('/') + 1);
+	this->on_change = on_change;
+
+	if (inotify_add_watch(ifd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) == -1)
+		cerr << "could not watch " << dir << ", changes to " << file << " will not be picked up: " << strerror(errno) << endl;
+}
+
+void scheduler::plan(void) {
+	heap = decltype(heap)();
+
+	time_t now = time(0);
+	for (auto& j : jobs) {
+		time_t t = j->sched->next(now);
+		if (t != -1) heap.emplace(t, j);
+	}
+}
+
+void scheduler::fire(shared_ptr<job> j) {
+	if (j->running && j->policy == SKIP) {
+		j->skipped++;
+		cerr << "skipping " << j->name << ", previous run still active (" << j->skipped << " skipped so far)" << endl;
+		report();
+		return;
+	}
+
+	if (j->running && j->policy == QUEUE) {
+		j->queued++;
+		cerr << "queueing " << j->name << ", previous run still active (" << j->queued << " queued)" << endl;
+		report();
+		return;
+	}
+
+	if (j->running) {
+		j->overlapped++;
+		cerr << "starting " << j->name << " while " << j->running << " previous runs are still active (" << j->overlapped << " overlapping so far)" << endl;
+	}
+
+	spawn(j);
+}
+
+void scheduler::spawn(shared_ptr<job> j) {
+	pid_t pid = fork();
+
+	if (pid == 0) {
+		sigprocmask(SIG_SETMASK, &oldmask, 0);
+
+		// every child opens the memfd anew, so each one reads the input from the start with its own offset
+		if (j->input != -1) {
+			string p = "/proc/self/fd/" + to_string(j->input);
+			int fd = open(p.c_str(), O_RDONLY);
+			if (fd == -1 || dup2(fd, 0) == -1) {
+				cerr << "could not open input for " << j->argv[0] << ": " << strerror(errno) << endl;
+				exit(1);
+			}
+			close(fd);
+		}
+
+		vector<char*> argv;
+		for (auto& a : j->argv) argv.push_back(const_cast<char*>(a.c_str()));
+		argv.push_back(0);
+
+		execvp(argv[0], argv.data());
+		cerr << "could not start " << argv[0] << ": " << strerror(errno) << endl;
+		exit(1);
+	}
+
+	else if (pid < 0)
+		cerr << "could not start " << j->argv[0] << ": " << strerror(errno) << endl;
+
+	else {
+		j->running++;
+		j->runs++;
+		children.emplace(pid, j);
+	}
+
+	report();
+}
+
+void scheduler::reap(void) {
+	struct signalfd_siginfo si;
+	while (read(sfd, &si, sizeof(si)) > 0);
+
+	pid_t pid;
+	while ((pid = waitpid(-1, 0, WNOHANG)) > 0) {
+		auto it = children.find(pid);
+		if (it == children.end()) continue;
+
+		auto j = it->second;
+		children.erase(it);
+		j->running--;
+
+		if (j->queued && !j->running) {
+			j->queued--;
+			spawn(j);
+		}
+		else report();
+	}
+}
+
+void scheduler::changes(void) {
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	bool changed = false;
+
+	ssize_t l;
+	while ((l = read(ifd, buf, sizeof(buf))) > 0)
+		for (char* p = buf; p < buf + l; ) {
+			auto ev = (struct inotify_event*) p;
+			if (ev->len && watched == ev->name) changed = true;
+			p += sizeof(struct inotify_event) + ev->len;
+		}
+
+	if (changed) on_change();
+}
+
+// One line per job: runs started, runs active, runs queued, runs skipped, runs started while others were active and the
+// job's name, separated by tabs. The file is replaced atomically, so readers never see a partial update.
+void scheduler::report(void) {
+	if (stats.empty()) return;
+
+	string tmp = stats + ".tmp";
+	{
+		ofstream out(tmp);
+		for (auto& j : jobs)
+			out << j->runs << "\t" << j->running << "\t" << j->queued << "\t" << j->skipped << "\t" << j->overlapped << "\t" << j->name << "\n";
+		if (!out) {
+			cerr << "could not write " << tmp << endl;
+			return;
+		}
+	}
+
+	if (rename(tmp.c_str(), stats.c_str()) == -1)
+		cerr << "could not replace " << stats << ": " << strerror(errno) << endl;
+}
+
+void scheduler::run(void) {
+	for (;;) {
+		struct itimerspec its = {};
+		if (!heap.empty()) its.it_value.tv_sec = heap.top().first;
+		if (timerfd_settime(tfd, TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET, &its, 0) == -1) {
+			cerr << "could not arm timerfd: " << strerror(errno) << endl;
+			exit(1);
+		}
+
+		struct pollfd fds[3] = { { tfd, POLLIN, 0 }, { sfd, POLLIN, 0 }, { ifd, POLLIN, 0 } };
+		if (poll(fds, ifd == -1 ? 2 : 3, -1) == -1) {
+			if (errno == EINTR) continue;
+			cerr << "poll failed: " << strerror(errno) << endl;
+			exit(1);
+		}
+
+		if (fds[0].revents & POLLIN) {
+			uint64_t n;
+			if (read(tfd, &n, sizeof(n)) == -1 && errno == ECANCELED) {
+				// the clock was set, all due times are recomputed instead of catching up
+				plan();
+				continue;
+			}
+
+			time_t now = time(0);
+			while (!heap.empty() && heap.top().first <= now) {
+				auto j = heap.top().second;
+				heap.pop();
+				fire(j);
+
+				time_t t = j->sched->next(now);
+				if (t != -1) heap.emplace(t, j);
+			}
+		}
+
+		if (fds[1].revents & POLLIN) reap();
+		if (ifd != -1 && (fds[2].revents & POLLIN)) changes();
+	}
+}
+
+int scheduler::seal(int in) {
+	int fd = memfd_create("input", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd == -1) throw runtime_error(string("could not create memfd: ") + strerror(errno));
+
+	char buf[65536];
+	ssize_t l;
+	while ((l = read(in, buf, sizeof(buf))) != 0) {
+		if (l == -1) {
+			if (errno == EINTR) continue;
+			throw runtime_error(string("could not read input: ") + strerror(errno));
+		}
+		for (char* p = buf; l > 0; ) {
+			ssize_t n = write(fd, p, l);
+			if (n == -1) throw runtime_error(string("could not store input: ") + strerror(errno));
+			p += n;
+			l -= n;
+		}
+	}
+
+	if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) == -1)
+		throw runtime_error(string("could not seal input: ") + strerror(errno));
+
+	return fd;
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+// Event loop running jobs on their time patterns, shared by cronexec and crontab.
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <queue>
+#include <string>
+#include <vector>
+
+#include <signal.h>
+
+#include "schedule.hpp"
+
+using namespace std;
+
+class scheduler {
+	public:
+		// what to do if a job is due while its previous run is still active: drop the run, run it once the previous
+		// one exited, or run it concurrently
+		enum policy_t { SKIP, QUEUE, ALLOW };
+		static bool parse_policy(const string& s, policy_t& p);
+
+		struct job {
+			string               line;        // identifies the job across reloads
+			string               name;        // for messages
+			shared_ptr<schedule> sched;
+			policy_t             policy = SKIP;
+			vector<string>       argv;
+			int                  input  = -1; // sealed memfd passed as stdin, or -1 to inherit stdin
+
+			unsigned             running    = 0;
+			unsigned             queued     = 0;
+			uint64_t             runs       = 0;
+			uint64_t             skipped    = 0;
+			uint64_t             overlapped = 0;
+		};
+
+		scheduler(void);
+
+		void set_jobs(const vector<shared_ptr<job>>& jobs);
+		const vector<shared_ptr<job>>& get_jobs(void);
+
+		void fire (shared_ptr<job> j);
+		void watch(const string& file, function<void(void)> on_change);
+		[[noreturn]] void run(void);
+
+		static int seal(int fd);
+
+	private:
+		typedef pair<time_t, shared_ptr<job>> entry;
+		struct later { bool operator()(const entry& a, const entry& b) const { return a.first > b.first; } };
+
+		vector<shared_ptr<job>>                     jobs;
+		priority_queue<entry, vector<entry>, later> heap;
+		map<pid_t, shared_ptr<job>>                 children;
+		sigset_t                                    oldmask;
+
+		int sfd, tfd, ifd;
+		string               watched;
+		function<void(void)> on_change;
+		string               stats; // WSUNIT_CRON_STATS, rewritten whenever a counter changes
+
+		void plan (void);
+		void spawn(shared_ptr<job> j);
+		void reap (void);
+		void changes(void);
+		void report (void);
+};
@@ -22,11 +22,17 @@ void tool::handle(int argc, char** argv) {
 	exit(1);
 }
 
+void add_blame(void);
 void add_cronexec(void);
+void add_crontab(void);
+void add_flightrec(void);
 void add_runas(void);
 
 int main(int argc, char** argv) {
+	add_blame();
 	add_cronexec();
+	add_crontab();
+	add_flightrec();
 	add_runas();
 	tool::handle(argc, argv);
 	return 0;
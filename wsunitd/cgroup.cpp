@@ -0,0 +1,191 @@
+#include "wsunitd.hpp"
+
+#include <fstream>
+#include <set>
+
+#include <fcntl.h>
+#include <signal.h>
+
+
+
+// With a delegated cgroup v2 directory, wsunitd moves itself into `<root>/wsunitd` and runs the scripts of every unit
+// in `<root>/units/<unit>/<script>`. Units live in a subtree of their own so that no unit name can refer to the cgroup
+// of wsunitd. The limits of a unit apply to `<root>/units/<unit>`, whose cgroup.events tells whether any process of the
+// unit is left.
+
+class cgroup_handler : public epoll_handler {
+	public:
+		cgroup_handler(const path& dir, const string& name) : name(name) {
+			fd = open((dir / "cgroup.events").c_str(), O_RDONLY | O_CLOEXEC);
+			if (fd == -1)
+				throw runtime_error("could not open " + (dir / "cgroup.events").string() + ": " + strerror(errno));
+		}
+
+		void handle(void) override {
+			char buf[256];
+			ssize_t n = pread(fd, buf, sizeof(buf) - 1, 0);
+			if (n <= 0) return;
+			buf[n] = '\0';
+
+			const char* p = strstr(buf, "populated ");
+			if (!p) return;
+			bool populated = p[10] == '1';
+
+			if (cgroup::populated_[name] != populated) {
+				LOG_DEBUG("cgroup of unit " + name + (populated ? " is populated" : " is empty"));
+				cgroup::populated_[name] = populated;
+			}
+		}
+
+	private:
+		string name;
+};
+
+path            cgroup::root;
+map<string, bool> cgroup::populated_;
+map<string, int>  cgroup::events_fd;
+
+void cgroup::init(const path& p) {
+	if (!is_regular_file(p / "cgroup.procs")) {
+		log::warn(p.string() + " is not a cgroup v2 directory, cgroups disabled");
+		return;
+	}
+
+	// processes may only live in leaves once controllers are enabled for the children
+	boost::system::error_code ec;
+	create_directory(p / "wsunitd", ec);
+	if (!write(p / "wsunitd" / "cgroup.procs", to_string(getpid()))) {
+		log::warn("could not move wsunitd into " + (p / "wsunitd").string() + ", cgroups disabled");
+		return;
+	}
+
+	create_directory(p / "units", ec);
+	if (!is_regular_file(p / "units" / "cgroup.procs")) {
+		log::warn("could not create " + (p / "units").string() + ", cgroups disabled");
+		return;
+	}
+
+	for (string c : { "memory", "cpu" })
+		if (!write(p / "cgroup.subtree_control", "+" + c) || !write(p / "units" / "cgroup.subtree_control", "+" + c))
+			log::warn("could not enable the " + c + " controller in " + p.string() + ", its limits and accounting are not available");
+
+	root = p;
+	log::note("using cgroup " + root.string());
+}
+
+bool cgroup::enabled(void) { return !root.empty(); }
+
+path cgroup::dir(const string& u) { return root / "units" / u; }
+
+void cgroup::setup(shared_ptr<unit> u) {
+	if (!enabled()) return;
+
+	path d = dir(u->name());
+	boost::system::error_code ec;
+	create_directory(d, ec);
+	if (ec) {
+		log::warn(u->term_name() + ": could not create cgroup " + d.string() + ": " + ec.message());
+		return;
+	}
+
+	if (populated_.count(u->name()) == 0)
+		try {
+			auto h = make_shared<cgroup_handler>(d, u->name());
+			epoll_add(h, EPOLLPRI);
+			events_fd[u->name()] = h->getfd();
+			h->handle();
+		}
+		catch (exception& ex) {
+			log::warn(u->term_name() + ": " + ex.what());
+		}
+
+	// limits are reset to "max" if the file was removed since the last start
+	for (string f : { "memory.max", "cpu.max" }) {
+		string v = "max";
+		path p = u->dir() / f;
+		if (is_regular_file(p)) getline(std::ifstream(p), v);
+		if (exists(d / f) && !write(d / f, v))
+			log::warn(u->term_name() + ": could not set " + f + " to \"" + v + "\"");
+	}
+}
+
+void cgroup::enter(const string& u, const string& script) {
+	if (!enabled()) return;
+
+	path d = dir(u) / script;
+	boost::system::error_code ec;
+	create_directories(d, ec);
+	if (ec || !write(d / "cgroup.procs", "0"))
+		log::warn("could not enter cgroup " + d.string() + ", continuing without");
+}
+
+void cgroup::signal(const string& u, const string& script, int signo) {
+	path d = script.empty() ? dir(u) : dir(u) / script;
+
+	// cgroup.kill (Linux 5.14) kills the whole subtree at once, without racing against forks
+	if (signo == SIGKILL && write(d / "cgroup.kill", "1")) return;
+
+	set<pid_t> pids;
+	boost::system::error_code ec;
+	if (!is_directory(d, ec)) return;
+
+	collect(d, pids);
+	for (recursive_directory_iterator it(d, ec), end; it != end; it.increment(ec))
+		if (is_directory(it->path(), ec)) collect(it->path(), pids);
+
+	for (pid_t pid : pids) kill(pid, signo);
+}
+
+void cgroup::remove(const string& u) {
+	auto it = events_fd.find(u);
+	if (it != events_fd.end()) {
+		epoll_del(it->second);
+		events_fd.erase(it);
+	}
+	populated_.erase(u);
+
+	if (!enabled()) return;
+
+	// a cgroup can only be removed once it has no processes and no children, so the script cgroups go first
+	path d = dir(u);
+	boost::system::error_code ec;
+	for (directory_iterator it(d, ec), end; it != end; it.increment(ec))
+		if (is_directory(it->path(), ec) && rmdir(it->path().c_str()) == -1)
+			log::warn("could not remove cgroup " + it->path().string() + ": " + strerror(errno));
+	if (rmdir(d.c_str()) == -1 && errno != ENOENT)
+		log::warn("could not remove cgroup " + d.string() + ": " + strerror(errno));
+}
+
+bool cgroup::populated(const string& u) {
+	auto it = populated_.find(u);
+	return it != populated_.end() && it->second;
+}
+
+uint64_t cgroup::memory(const string& u) {
+	uint64_t v = 0;
+	std::ifstream(dir(u) / "memory.current") >> v;
+	return v;
+}
+
+uint64_t cgroup::cpu_usec(const string& u) {
+	std::ifstream in(dir(u) / "cpu.stat");
+	string   k;
+	uint64_t v;
+	while (in >> k >> v)
+		if (k == "usage_usec") return v;
+	return 0;
+}
+
+void cgroup::collect(const path& d, set<pid_t>& pids) {
+	std::ifstream in(d / "cgroup.procs");
+	pid_t pid;
+	while (in >> pid) pids.insert(pid);
+}
+
+bool cgroup::write(const path& p, const string& s) {
+	int fd = open(p.c_str(), O_WRONLY | O_CLOEXEC);
+	if (fd == -1) return false;
+	bool ok = ::write(fd, s.data(), s.size()) == (ssize_t) s.size();
+	close(fd);
+	return ok;
+}
@@ -1,23 +1,48 @@
 #include "wsunitd.hpp"
 
+#include <algorithm>
 #include <fstream>
 #include <sstream>
 
+#include <signal.h>
+
 
 
 void depgraph::refresh(void) {
 	mkdirs();
+
+	if (decls.empty()) load_cache();
+	if (scan() || cache_partial) save_cache();
+	instantiate();
+
 	del_old_units();
 	add_new_units();
 	del_old_deps ();
 	add_new_deps ();
 	verify_deps  ();
+
+	for (auto& [n, np] : nodes) {
+		reexec::restore(np->u);
+		np->u->reschedule();
+		np->u->bind_sockets();
+	}
+
+	if (durations.empty()) load_durations();
+	pressure::configure();
 }
 
 void depgraph::start_stop_units(void) {
-	for (auto& [n, np] : nodes)
-		if (np->u->needed() && !np->u->blocked()) start(np->u, false);
-		else                                      stop (np->u, false);
+	read_start_limit();
+	prioritize();
+
+	map<string, bool> blocked;
+	for (auto& [n, np] : nodes) {
+		np->u->set_target(np->u->needed() && !np->u->blocked(&blocked));
+		settle_update(np->u);
+
+		if (np->u->target()) start(np->u, false);
+		else                 stop (np->u, false);
+	}
 
 	queue_step();
 }
@@ -26,7 +51,7 @@ void depgraph::start(shared_ptr<unit> u, bool now) {
 	filter(to_start, [&u](weak_ptr<unit>& w) { return with_weak_ptr(w, false, [&u](shared_ptr<unit>& u_) { return u_->name() != u->name(); }); });
 	filter(to_stop , [&u](weak_ptr<unit>& w) { return with_weak_ptr(w, false, [&u](shared_ptr<unit>& u_) { return u_->name() != u->name(); }); });
 
-	log::debug("add unit " + u->term_name() + " to start queue");
+	LOG_DEBUG("add unit " + u->term_name() + " to start queue");
 	to_start.push_back(u);
 	if (now) queue_step();
 }
@@ -35,7 +60,10 @@ void depgraph::stop(shared_ptr<unit> u, bool now) {
 	filter(to_start, [&u](weak_ptr<unit>& w) { return with_weak_ptr(w, false, [&u](shared_ptr<unit>& u_) { return u_->name() != u->name(); }); });
 	filter(to_stop , [&u](weak_ptr<unit>& w) { return with_weak_ptr(w, false, [&u](shared_ptr<unit>& u_) { return u_->name() != u->name(); }); });
 
-	log::debug("add unit " + u->term_name() + " to stop queue");
+	// the wait before a later start counts from when it is queued again
+	u->unqueue();
+
+	LOG_DEBUG("add unit " + u->term_name() + " to stop queue");
 	to_stop.push_back(u);
 	if (now) queue_step();
 }
@@ -56,6 +84,12 @@ bool depgraph::contains(const vector<weak_ptr<node>>& v, const string& name) {
 
 map<string, shared_ptr<depgraph::node>> depgraph::nodes;
 
+vector<shared_ptr<unit>> depgraph::get_units(void) {
+	vector<shared_ptr<unit>> ret;
+	for (auto& [n, np] : nodes) ret.push_back(np->u);
+	return ret;
+}
+
 vector<shared_ptr<unit>> depgraph::get_deps(string name) {
 	try {
 		auto& n = nodes.at(name);
@@ -83,14 +117,14 @@ vector<shared_ptr<unit>> depgraph::get_revdeps(string name) {
 void depgraph::del_old_units(void) {
 	auto it = nodes.begin();
 	while (it != nodes.end())
-		if (is_directory(confdir / it->first))
+		if (is_unit_dir(it->first))
 			++it;
 
 		else if (it->second->u->running()) {
 			// remove all links to the graph, unit will be safely stopped as it is no longer needed(), and then remain
 			// idle in the graph until the next refresh
 
-			log::debug("unlink old unit " + it->second->u->term_name() + " from depgraph");
+			LOG_DEBUG("unlink old unit " + it->second->u->term_name() + " from depgraph");
 			it->second->deps.clear();
 			it->second->revdeps.clear();
 
@@ -100,19 +134,26 @@ void depgraph::del_old_units(void) {
 			++it;
 		}
 		else {
-			log::debug("remove old unit " + it->second->u->term_name() + " from depgraph");
+			LOG_DEBUG("remove old unit " + it->second->u->term_name() + " from depgraph");
+			unsettled.erase(it->first);
+			remove(statedir / "usage" / it->first);
+			remove(statedir / "health" / it->first);
+			cgroup::remove(it->first);
 			it = nodes.erase(it);
 		}
 }
 
 void depgraph::add_new_units(void) {
-	for (directory_entry& d : directory_iterator(confdir)) {
-		string n = d.path().filename().string();
+	auto add = [](const string& n, const string& tmpl) {
 		if (nodes.count(n) == 0) {
-			log::debug("add new unit " + n + " to depgraph");
-			nodes.emplace(n, make_shared<depgraph::node>(unit::create(n)));
+			LOG_DEBUG("add new unit " + n + " to depgraph");
+			nodes.emplace(n, make_shared<depgraph::node>(unit::create(n, tmpl)));
 		}
-	}
+	};
+
+	// a directory named like an instance is a unit of its own, only real instances use the directory of their template
+	for (auto& n : listed) if (!unit::is_template(n)) add(n, "");
+	for (auto& [n, d] : instances) add(n, unit::template_of(n));
 }
 
 void depgraph::del_old_deps(void) {
@@ -120,10 +161,10 @@ void depgraph::del_old_deps(void) {
 		filter(np->deps, [&n = n, &np = np](weak_ptr<node>& dp) {
 			return with_weak_ptr(dp, false, [n, np](shared_ptr<node>& dep) {
 				if (
-					!is_directory(dep->u->dir()) ||
-					!(exists(np->u->dir() / "deps" / dep->u->name()) || exists(dep->u->dir() / "revdeps" / np->u->name()))
+					!is_unit_dir(dep->u->name()) ||
+					!(declared(n, D_DEPS, dep->u->name()) || declared(dep->u->name(), D_REVDEPS, n) || socket_dep(n, dep->u->name()))
 				) {
-					log::debug("remove old dep " + n + " -> " + dep->u->name() + " from depgraph");
+					LOG_DEBUG("remove old dep " + n + " -> " + dep->u->name() + " from depgraph");
 					return false;
 				}
 				return true;
@@ -133,10 +174,10 @@ void depgraph::del_old_deps(void) {
 		filter(np->revdeps, [&n = n, &np = np](weak_ptr<node>& rp) {
 			return with_weak_ptr(rp, false, [n, np](shared_ptr<node>& revdep) {
 				if (
-					!is_directory(revdep->u->dir()) ||
-					!(exists(revdep->u->dir() / "deps" / np->u->name()) || exists(np->u->dir() / "revdeps" / revdep->u->name()))
+					!is_unit_dir(revdep->u->name()) ||
+					!(declared(revdep->u->name(), D_DEPS, n) || declared(n, D_REVDEPS, revdep->u->name()) || socket_dep(revdep->u->name(), n))
 				) {
-					log::debug("remove old revdep " + revdep->u->name() + " <- " + n + " from depgraph");
+					LOG_DEBUG("remove old revdep " + revdep->u->name() + " <- " + n + " from depgraph");
 					return false;
 				}
 				return true;
@@ -147,20 +188,24 @@ void depgraph::del_old_deps(void) {
 
 void depgraph::add_new_deps(void) {
 	for (auto& [n, np] : nodes) {
-		path npath = np->u->dir();
-		path dpath = npath / "deps";
-		path rpath = npath / "revdeps";
-
-		if (is_directory(dpath))
-			for (directory_entry& d : directory_iterator(dpath))
-				adddep(d.path().filename().string(), n);
-
-		if (is_directory(rpath))
-			for (directory_entry& r : directory_iterator(rpath))
-				adddep(n, r.path().filename().string());
+		auto it = decls.find(n);
+		if (it == decls.end() && (it = instances.find(n)) == instances.end()) continue;
+		auto& names = it->second.names;
+
+		for (auto& d : names[D_DEPS          ]) adddep(d, n);
+		for (auto& r : names[D_REVDEPS       ]) adddep(n, r);
+		for (auto& d : names[D_SOCKET_DEPS   ]) adddep(d, n);
+		for (auto& r : names[D_SOCKET_REVDEPS]) adddep(n, r);
 	}
 }
 
+// A dependency that is only declared in socket-deps / socket-revdeps is satisfied once the sockets of the dependency
+// are bound, it otherwise behaves like any other dependency.
+bool depgraph::socket_dep(const string& name, const string& dep) {
+	if (declared(name, D_DEPS, dep) || declared(dep, D_REVDEPS, name)) return false;
+	return declared(name, D_SOCKET_DEPS, dep) || declared(dep, D_SOCKET_REVDEPS, name);
+}
+
 void depgraph::verify_deps(void) {
 	for (auto& [n, np] : nodes) {
 		map<string, bool> visited;
@@ -217,8 +262,8 @@ void depgraph::adddep(string fst, string snd) {
 	shared_ptr<node> a = nodes.at(fst);
 	shared_ptr<node> b = nodes.at(snd);
 
-	if (!contains(a->revdeps, b->u->name())) { log::debug("add revdep " + fst + " <- " + snd + " to depgraph"); a->revdeps.emplace_back(b); }
-	if (!contains(b->   deps, a->u->name())) { log::debug("add dep "    + snd + " -> " + fst + " to depgraph"); b->   deps.emplace_back(a); }
+	if (!contains(a->revdeps, b->u->name())) { LOG_DEBUG("add revdep " + fst + " <- " + snd + " to depgraph"); a->revdeps.emplace_back(b); }
+	if (!contains(b->   deps, a->u->name())) { LOG_DEBUG("add dep "    + snd + " -> " + fst + " to depgraph"); b->   deps.emplace_back(a); }
 }
 
 void depgraph::rmdep(string fst, string snd) {
@@ -246,37 +291,175 @@ void depgraph::queue_step(void) {
 		stop_step (changed);
 		start_step(changed);
 		write_state();
-		if (changed) log::debug("global state changed, re-processing queues");
-		else         log::debug("no global state change, done processing queues");
+		if (changed) LOG_DEBUG("global state changed, re-processing queues");
+		else         LOG_DEBUG("no global state change, done processing queues");
 	} while (changed);
 
 	if (in_shutdown) {
 		for (auto& [n, np] : nodes)
 			if (!np->u->needed() && np->u->running()) {
-				log::debug("shutdown: waiting for " + np->u->term_name());
+				LOG_DEBUG("shutdown: waiting for " + np->u->term_name());
 				return;
 			}
 
 		if (nodes.count("@shutdown") > 0 && !nodes.at("@shutdown")->u->ready())
 			return;
 
+		for (auto& [n, np] : nodes)
+			if (!np->u->running() && cgroup::populated(n)) {
+				log::warn(np->u->term_name() + ": processes left after the unit went down, killing");
+				cgroup::signal(n, "", SIGKILL);
+			}
+
 		exit(0);
 	}
 }
 
-bool depgraph::is_settled(string* reason) {
-	for (auto& [n, np] : nodes)
-		if (np->u->running() && (!np->u->needed() || np->u->blocked())) {
-			if (reason) *reason = "settle: waiting for " + np->u->term_name() + " to go down";
-			return false;
-		}
-	return true;
+// The set of running units that should be down is kept up to date by start_stop_units, which decides what should be
+// down, and by every state change, so checking whether the system settled does not walk the graph.
+
+set<string> depgraph::unsettled;
+
+bool depgraph::is_settled(reason_t* reason) {
+	if (unsettled.empty()) return true;
+	if (reason) {
+		auto it = nodes.find(*unsettled.begin());
+		*reason = reason_t(R_WAIT_SETTLE, it != nodes.end() ? it->second->u : 0);
+	}
+	return false;
+}
+
+void depgraph::settle_update(shared_ptr<unit> u) {
+	bool was = unsettled.count(u->name()) > 0;
+	bool is  = u->running() && !u->target();
+	if (was == is) return;
+
+	if (is) unsettled.insert(u->name());
+	else    unsettled.erase (u->name());
+
+	if (unsettled.empty()) LOG_DEBUG("all units settled");
+	if (trace::enabled()) trace::counter("unsettled", unsettled.size());
+}
+
+void depgraph::state_changed(shared_ptr<unit> u) {
+	settle_update(u);
+
+	auto s = u->get_state();
+	if (s == unit::IN_LOGROT || s == unit::IN_START || s == unit::IN_RDY) starting.insert(u->name());
+	else                                                                  starting.erase (u->name());
+
+	if (s == unit::UP && u->timing().started) {
+		double d = (u->timing().ready - u->timing().started) / 1e9;
+		auto it = durations.find(u->name());
+		durations[u->name()] = it == durations.end() ? d : (it->second + d) / 2;
+		durations_dirty = true;
+	}
+}
+
+
+
+// With `WSUNIT_CONFIG_DIR/start-limit`, at most that many units are starting (between leaving _down_ and becoming
+// _ready_) at once, or with `auto`, twice the number of CPUs minus the load average, scaled down by the share of time
+// tasks stalled on I/O (/proc/pressure/io). The start queue is ordered by the longest chain of start durations from
+// each unit through its reverse dependencies, so units that others wait for are started first. Durations are averaged
+// over the previous starts, kept in `WSUNIT_LOG_DIR/_durations` across boots.
+
+int                 depgraph::start_limit;
+unsigned            depgraph::start_slots;
+map<string, double> depgraph::durations;
+bool                depgraph::durations_dirty;
+map<string, double> depgraph::priority;
+set<string>         depgraph::starting;
+
+bool depgraph::may_start(shared_ptr<unit> u, reason_t* reason) {
+	if (start_limit != 0 && starting.size() >= start_slots) {
+		if (reason) *reason = reason_t(R_START_LIMIT);
+		return false;
+	}
+	return pressure::admit(u, starting.size(), reason);
+}
+
+void depgraph::read_start_limit(void) {
+	start_limit = 0;
+
+	path p = confdir / "start-limit";
+	if (!is_regular_file(p)) return;
+
+	string v;
+	std::ifstream(p) >> v;
+	if (v == "auto") {
+		start_limit = -1;
+		return;
+	}
+
+	try {
+		start_limit = stoi(v);
+	}
+	catch (exception& ex) {}
+
+	if (start_limit <= 0) {
+		log::warn("could not parse " + p.string() + ", expected a positive number or \"auto\"");
+		start_limit = 0;
+	}
+}
+
+unsigned depgraph::current_start_limit(void) {
+	if (start_limit >= 0) return start_limit;
+
+	double load[1] = { 0 };
+	getloadavg(load, 1);
+
+	// first line: some avg10=<percent> avg60=... avg300=... total=...
+	double stall = 0;
+	string some, avg10;
+	std::ifstream in("/proc/pressure/io");
+	if (in >> some >> avg10 && avg10.compare(0, 6, "avg10=") == 0) stall = atof(avg10.c_str() + 6);
+
+	double l = (2.0 * sysconf(_SC_NPROCESSORS_ONLN) - load[0]) * (1 - stall / 100);
+	return l < 1 ? 1 : l;
+}
+
+void depgraph::load_durations(void) {
+	std::ifstream in(logdir / "_durations");
+	string n;
+	double d;
+	while (in >> n >> d) durations[n] = d;
+}
+
+void depgraph::save_durations(void) {
+	path p = logdir / "_durations";
+	{
+		std::ofstream out(p.string() + ".tmp");
+		for (auto& [n, d] : durations) out << n << "\t" << d << "\n";
+	}
+	rename(p.string() + ".tmp", p);
+	durations_dirty = false;
+}
+
+void depgraph::prioritize(void) {
+	map<string, double> memo;
+	for (auto& [n, np] : nodes) chain(n, memo);
+	priority = memo;
+}
+
+// units without a recorded duration count as 0.1s, so longer chains of them still come first
+double depgraph::chain(const string& name, map<string, double>& memo) {
+	auto it = memo.find(name);
+	if (it != memo.end()) return it->second;
+
+	auto d = durations.find(name);
+	double longest = 0;
+	for (auto& r : get_revdeps(name)) longest = max(longest, chain(r->name(), memo));
+
+	return memo[name] = (d == durations.end() ? 0.1 : d->second) + longest;
 }
 
 void depgraph::report(void) {
-	log::debug("current state:");
+	if (!log::verbose) return;
+
+	LOG_DEBUG("current state:");
 	for (auto& [n, np] : nodes)
-		log::debug(" - " + np->u->term_name() + " " + unit::term_state_descr(np->u->get_state()) + " "
+		LOG_DEBUG(" - " + np->u->term_name() + " " + unit::term_state_descr(np->u->get_state()) + " "
 			+ (np->u->needed   () ? "\x1b[32mN\x1b[0m" : "n")
 			+ (np->u->wanted   () ? "\x1b[32mW\x1b[0m" : "w")
 			+ (np->u->masked   () ? "\x1b[31mM\x1b[0m" : "m")
@@ -285,65 +468,97 @@ void depgraph::report(void) {
 			+ (np->u->can_stop () ? "\x1b[34mD\x1b[0m" : "d")
 		);
 
-	log::debug("start queue:");
+	LOG_DEBUG("start queue:");
 	for (auto& u : to_start)
-		log::debug(" - " + with_weak_ptr(u, string("?"), [](shared_ptr<unit> u){ return u->term_name(); }));
+		LOG_DEBUG(" - " + with_weak_ptr(u, string("?"), [](shared_ptr<unit> u){ return u->term_name(); }));
 
-	log::debug("stop queue:");
+	LOG_DEBUG("stop queue:");
 	for (auto& u : to_stop)
-		log::debug(" - " + with_weak_ptr(u, string("?"), [](shared_ptr<unit> u){ return u->term_name(); }));
+		LOG_DEBUG(" - " + with_weak_ptr(u, string("?"), [](shared_ptr<unit> u){ return u->term_name(); }));
 }
 
 void depgraph::start_step(bool& changed) {
-	log::debug("start queue (length " + to_string(to_start.size()) + "):");
-	for (auto& p : to_start)
-		log::debug(" - " + with_weak_ptr(p, string("<stale>"), [](shared_ptr<unit> p){ return p->name(); }));
+	start_slots = current_start_limit();
+
+	stable_sort(to_start.begin(), to_start.end(), [](const weak_ptr<unit>& a, const weak_ptr<unit>& b) {
+		auto prio = [](const weak_ptr<unit>& w) {
+			return with_weak_ptr(w, 0.0, [](shared_ptr<unit> u) {
+				auto it = priority.find(u->name());
+				return it == priority.end() ? 0.0 : it->second;
+			});
+		};
+		return prio(a) > prio(b);
+	});
+
+	if (log::verbose) {
+		LOG_DEBUG("start queue (length " + to_string(to_start.size()) + "):");
+		for (auto& p : to_start)
+			LOG_DEBUG(" - " + with_weak_ptr(p, string("<stale>"), [](shared_ptr<unit> p){ return p->name(); }));
+	}
 
-	filter(to_start, [&changed](weak_ptr<unit> w) {
+	map<string, bool> blocked;
+	filter(to_start, [&changed, &blocked](weak_ptr<unit> w) {
 		auto u = w.lock();
-		string reason = "?";
+		reason_t reason;
 
 		if (u) {
-			if (!u->request_start(&reason)) {
-				log::debug("keep unit " + (u ? u->name() : string("?")) + " in start queue: " + reason);
+			if (!u->request_start(&reason, &blocked)) {
+				LOG_DEBUG("keep unit " + (u ? u->name() : string("?")) + " in start queue: " + reason.str());
+				if (trace::enabled()) trace::queue("start", u->name(), true, reason.str());
+				flightrec::queue(u, 0, true, reason);
 				return true;
 			}
 		}
 		else
-			reason = "stale unit";
+			reason = reason_t(R_STALE);
 
-		log::debug("drop unit " + (u ? u->name() : string("?")) + " from start queue: " + reason);
+		LOG_DEBUG("drop unit " + (u ? u->name() : string("?")) + " from start queue: " + reason.str());
+		if (trace::enabled()) trace::queue("start", u ? u->name() : string("?"), false, reason.str());
+		flightrec::queue(u, 0, false, reason);
 		changed = true;
 		return false;
 	});
+
+	if (trace::enabled()) trace::counter("start queue", to_start.size());
+	if (trace::enabled()) trace::counter("starting", starting.size());
+
+	if (durations_dirty && starting.empty()) save_durations();
 }
 
 void depgraph::stop_step(bool& changed) {
-	log::debug("stop queue (length " + to_string(to_stop.size()) + "):");
-	for (auto& p : to_stop)
-		log::debug(" - " + with_weak_ptr(p, string("<stale>"), [](shared_ptr<unit> p){ return p->name(); }));
+	if (log::verbose) {
+		LOG_DEBUG("stop queue (length " + to_string(to_stop.size()) + "):");
+		for (auto& p : to_stop)
+			LOG_DEBUG(" - " + with_weak_ptr(p, string("<stale>"), [](shared_ptr<unit> p){ return p->name(); }));
+	}
 
 	filter(to_stop, [&changed](weak_ptr<unit> w) {
 		auto u = w.lock();
-		string reason = "?";
+		reason_t reason;
 
 		if (u) {
 			if (!u->request_stop(&reason)) {
-				log::debug("keep unit " + (u ? u->name() : string("?")) + " in stop queue: " + reason);
+				LOG_DEBUG("keep unit " + (u ? u->name() : string("?")) + " in stop queue: " + reason.str());
+				if (trace::enabled()) trace::queue("stop", u->name(), true, reason.str());
+				flightrec::queue(u, 1, true, reason);
 				return true;
 			}
 		}
 		else
-			reason = "stale unit";
+			reason = reason_t(R_STALE);
 
-		log::debug("drop unit " + (u ? u->name() : string("?")) + " from stop queue: " + reason);
+		LOG_DEBUG("drop unit " + (u ? u->name() : string("?")) + " from stop queue: " + reason.str());
+		if (trace::enabled()) trace::queue("stop", u ? u->name() : string("?"), false, reason.str());
+		flightrec::queue(u, 1, false, reason);
 		changed = true;
 		return false;
 	});
+
+	if (trace::enabled()) trace::counter("stop queue", to_stop.size());
 }
 
 void depgraph::write_state(void) {
-	log::debug("update state files");
+	LOG_DEBUG("update state files");
 
 	for (auto& [n, np] : nodes) {
 		auto rf = statedir / "running" / np->u->name();
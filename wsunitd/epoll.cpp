@@ -11,7 +11,7 @@
 
 class signal_handler : public epoll_handler {
 	public:
-		signal_handler(int epfd) {
+		signal_handler(void) {
 			sigset_t sigs;
 			assert(sigemptyset(&sigs) == 0);
 			assert(sigaddset(&sigs, SIGUSR1) == 0);
@@ -19,23 +19,21 @@ class signal_handler : public epoll_handler {
 			assert(sigaddset(&sigs, SIGCHLD) == 0);
 			assert(sigaddset(&sigs, SIGTERM) == 0);
 			assert(sigaddset(&sigs, SIGINT ) == 0);
+			assert(sigaddset(&sigs, SIGQUIT) == 0);
+			assert(sigaddset(&sigs, SIGHUP ) == 0);
 			assert(sigprocmask(SIG_BLOCK, &sigs, 0) == 0);
 
 			fd = signalfd(-1, &sigs, SFD_CLOEXEC | SFD_NONBLOCK);
 			if (fd == -1)
 				throw runtime_error(string("could not create signalfd: ") + strerror(errno));
-
-			struct epoll_event ev;
-			ev.events  = EPOLLIN;
-			ev.data.fd = fd;
-			if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1)
-				throw runtime_error(string("could not register signalfd with epoll: ") + strerror(errno));
 		}
 
 		void handle(void) override {
 			struct signalfd_siginfo info;
 			ssize_t n;
-			while ((n = read(fd, &info, sizeof(struct signalfd_siginfo))) != -1)
+			while ((n = read(fd, &info, sizeof(struct signalfd_siginfo))) != -1) {
+				flightrec::signal(info.ssi_signo);
+
 				switch (info.ssi_signo) {
 					case SIGUSR1:
 						log::note("received \x1b[36mSIGUSR1\x1b[0m, recalculate set of needed units");
@@ -49,7 +47,7 @@ class signal_handler : public epoll_handler {
 					break;
 
 					case SIGCHLD:
-						log::debug("received \x1b[36mSIGCHLD\x1b[0m, handle zombies");
+						LOG_DEBUG("received \x1b[36mSIGCHLD\x1b[0m, handle zombies");
 						waitall();
 					break;
 
@@ -65,10 +63,21 @@ class signal_handler : public epoll_handler {
 						depgraph::start_stop_units();
 					break;
 
+					case SIGQUIT:
+						log::note("received \x1b[36mSIGQUIT\x1b[0m, dump flight recorder");
+						flightrec::dump();
+					break;
+
+					case SIGHUP:
+						log::note("received \x1b[36mSIGHUP\x1b[0m, re-exec");
+						reexec::request();
+					break;
+
 					default:
-						log::debug("ignore signal " + signal_string(info.ssi_signo));
+						LOG_DEBUG("ignore signal " + signal_string(info.ssi_signo));
 					break;
 				}
+			}
 
 			if (errno != EAGAIN && errno != EWOULDBLOCK)
 				log::warn(string("reading signal fd failed: ") + strerror(errno));
@@ -77,7 +86,7 @@ class signal_handler : public epoll_handler {
 
 class event_fifo_handler : public epoll_handler {
 	public:
-		event_fifo_handler(int epfd) {
+		event_fifo_handler(void) {
 			// TODO: this could be written better
 			if (!is_other(statedir / "events") || access((statedir / "events").c_str(), R_OK) == -1)
 				if (mkfifo((statedir / "events").c_str(), 0600) == -1)
@@ -92,28 +101,20 @@ class event_fifo_handler : public epoll_handler {
 				close(fd);
 				throw runtime_error(string("failed to open events fifo: ") + strerror(errno));
 			}
-
-			struct epoll_event ev;
-			ev.events  = EPOLLIN;
-			ev.data.fd = fd;
-			if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
-				close(fd);
-				throw runtime_error(string("could not register event fifo with epoll: ") + strerror(errno));
-			}
 		}
 
 		void handle(void) override {
 			static char   buf[PIPE_BUF];
 			static size_t pos = 0;
 
-			log::debug("activity on event fd registered");
+			LOG_DEBUG("activity on event fd registered");
 
 			for (;;) {
 				ssize_t n = read(fd, buf + pos, 1);
-				log::debug("read event fd: " + string(buf + pos, 1) + ", returned " + to_string(n));
+				LOG_DEBUG("read event fd: " + string(buf + pos, 1) + ", returned " + to_string(n));
 
 				if (n == -1) {
-					log::debug(string("errno: ") + strerror(errno));
+					LOG_DEBUG(string("errno: ") + strerror(errno));
 					if (errno != EAGAIN || errno != EWOULDBLOCK)
 						log::err(string("failed to read event fifo: ") + strerror(errno));
 
@@ -124,7 +125,7 @@ class event_fifo_handler : public epoll_handler {
 					string ev(buf, pos);
 					log::note("received event: " + ev);
 					depgraph::handle(ev);
-					log::debug("event handling complete");
+					LOG_DEBUG("event handling complete");
 					pos = 0;
 					return;
 				}
@@ -138,7 +139,7 @@ class event_fifo_handler : public epoll_handler {
 				}
 
 				++pos;
-				log::debug(string("onto next character, now at ") + to_string(pos));
+				LOG_DEBUG(string("onto next character, now at ") + to_string(pos));
 
 				if (pos >= sizeof(buf)) {
 					log::warn("event too long, discard ...");
@@ -152,7 +153,6 @@ class event_fifo_handler : public epoll_handler {
 
 		~event_fifo_handler(void) override {
 			close(fd_);
-			close(fd );
 		}
 
 	private:
@@ -162,23 +162,53 @@ class event_fifo_handler : public epoll_handler {
 
 
 void waitall(void) {
-	int status;
-	pid_t pid;
-	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) term_handle(pid, status);
+	backend::current->reap();
 }
 
-void main_loop(void) {
-	map<int,shared_ptr<epoll_handler>> evmap;
+static int epfd = -1;
+static map<int, shared_ptr<epoll_handler>> evmap;
 
-	int epfd = epoll_create1(EPOLL_CLOEXEC);
+static int epoll_fd(void) {
 	if (epfd == -1) {
-		log::fatal(string("could not create epoll fd: ") + strerror(errno));
-		exit(1);
+		epfd = epoll_create1(EPOLL_CLOEXEC);
+		if (epfd == -1) {
+			log::fatal(string("could not create epoll fd: ") + strerror(errno));
+			exit(1);
+		}
 	}
+	return epfd;
+}
+
+void epoll_add(shared_ptr<epoll_handler> h, uint32_t events) {
+	struct epoll_event ev;
+	ev.events  = events;
+	ev.data.fd = h->getfd();
+	if (epoll_ctl(epoll_fd(), EPOLL_CTL_ADD, h->getfd(), &ev) == -1)
+		throw runtime_error(string("could not register fd with epoll: ") + strerror(errno));
+	evmap[h->getfd()] = h;
+}
 
+bool epoll_mod(int fd, uint32_t events) {
+	struct epoll_event ev;
+	ev.events  = events;
+	ev.data.fd = fd;
+	if (epoll_ctl(epoll_fd(), EPOLL_CTL_MOD, fd, &ev) == -1) {
+		log::warn(string("could not modify fd in epoll: ") + strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+void epoll_del(int fd) {
+	if (evmap.count(fd) == 0) return;
+	if (epoll_ctl(epoll_fd(), EPOLL_CTL_DEL, fd, 0) == -1)
+		log::warn(string("could not unregister fd from epoll: ") + strerror(errno));
+	evmap.erase(fd);
+}
+
+void main_loop(void) {
 	try {
-		shared_ptr<epoll_handler> h = make_shared<signal_handler>(epfd);
-		evmap.emplace(h->getfd(), h);
+		epoll_add(make_shared<signal_handler>());
 	}
 	catch (exception& ex) {
 		log::warn(ex.what());
@@ -187,8 +217,7 @@ void main_loop(void) {
 	}
 
 	try {
-		shared_ptr<epoll_handler> h = make_shared<event_fifo_handler>(epfd);
-		evmap.emplace(h->getfd(), h);
+		epoll_add(make_shared<event_fifo_handler>());
 	}
 	catch (exception& ex) {
 		log::warn(ex.what());
@@ -196,20 +225,27 @@ void main_loop(void) {
 	}
 
 	for (;;) {
-		log::debug("check for pending zombies");
+		LOG_DEBUG("check for pending zombies");
 		waitall();
 
+		reexec::poll();
 		depgraph::report();
+		metrics::write();
+		trace::flush();
 
-		log::debug("wait for next event");
+		LOG_DEBUG("wait for next event");
 
 		struct epoll_event ev;
-		int fds = epoll_wait(epfd, &ev, 1, -1);
+		int fds = epoll_wait(epoll_fd(), &ev, 1, -1);
 
-		if (fds == -1) log::warn(string("epoll_wait failed: ") + strerror(errno));
+		if (fds == -1) {
+			if (errno != EINTR) log::warn(string("epoll_wait failed: ") + strerror(errno));
+		}
 		else
 			try {
-				evmap.at(ev.data.fd)->handle();
+				// keep the handler alive even if it unregisters itself
+				shared_ptr<epoll_handler> h = evmap.at(ev.data.fd);
+				h->handle();
 			}
 			catch (out_of_range& ex) {
 				log::warn(string("unknown epoll fd event: ") + to_string(ev.data.fd));
@@ -0,0 +1,104 @@
+#include "wsunitd.hpp"
+
+#include <fstream>
+
+
+
+flightrec_record      flightrec::ring[flightrec::size];
+uint64_t              flightrec::count;
+vector<string>        flightrec::names;
+map<string, uint32_t> flightrec::ids;
+
+void flightrec::state(shared_ptr<unit> u, unit::state_t from, unit::state_t to) {
+	auto& r = next(FR_STATE, u);
+	r.a = from;
+	r.b = to;
+}
+
+void flightrec::queue(shared_ptr<unit> u, int queue, bool keep, const reason_t& reason) {
+	auto& r = next(FR_QUEUE, u);
+	r.a     = queue;
+	r.b     = reason.code;
+	r.keep  = keep;
+	r.other = id(reason.other);
+}
+
+void flightrec::spawn(shared_ptr<unit> u, const string& script, pid_t pid) {
+	auto& r = next(FR_SPAWN, u);
+	r.a   = script_kind_of(script);
+	r.pid = pid;
+}
+
+void flightrec::exit(shared_ptr<unit> u, const string& script, pid_t pid, int status) {
+	auto& r = next(FR_EXIT, u);
+	r.a     = script_kind_of(script);
+	r.pid   = pid;
+	r.value = status;
+}
+
+void flightrec::signal(int signo) {
+	auto& r = next(FR_SIGNAL, 0);
+	r.value = signo;
+}
+
+void flightrec::dump(void) {
+	if (statedir.empty()) return;
+
+	path p = statedir / "flightrec";
+	path t = statedir / "flightrec.tmp";
+
+	uint64_t n     = count < size ? count : size;
+	uint64_t first = count - n;
+
+	flightrec_header h = {};
+	h.magic   = flightrec_magic;
+	h.version = flightrec_version;
+	h.started = started_at;
+	h.dumped  = monotime();
+	h.names   = names.size();
+	h.records = n;
+
+	{
+		std::ofstream out(t, ios::binary);
+		out.write((const char*) &h, sizeof(h));
+		for (auto& s : names) {
+			uint16_t l = s.size();
+			out.write((const char*) &l, sizeof(l));
+			out.write(s.data(), l);
+		}
+		for (uint64_t i = first; i < count; ++i)
+			out.write((const char*) &ring[i % size], sizeof(flightrec_record));
+
+		if (!out) {
+			log::warn("could not write flight recorder dump " + t.string());
+			return;
+		}
+	}
+
+	boost::system::error_code ec;
+	rename(t, p, ec);
+	if (ec) log::warn("could not replace flight recorder dump " + p.string() + ": " + ec.message());
+	else    log::note("dumped " + to_string(n) + " flight recorder entries to " + p.string());
+}
+
+flightrec_record& flightrec::next(uint8_t type, shared_ptr<unit> u) {
+	auto& r = ring[count++ % size];
+	r = flightrec_record{};
+	r.time  = monotime();
+	r.type  = type;
+	r.unit  = id(u);
+	r.other = flightrec_none;
+	return r;
+}
+
+uint32_t flightrec::id(shared_ptr<unit> u) {
+	if (!u) return flightrec_none;
+
+	auto it = ids.find(u->name());
+	if (it != ids.end()) return it->second;
+
+	uint32_t i = names.size();
+	names.push_back(u->name().substr(0, UINT16_MAX));
+	ids.emplace(u->name(), i);
+	return i;
+}
@@ -0,0 +1,116 @@
+#pragma once
+
+// Record format of the wsunitd flight recorder, shared with the decoder in unittool.
+
+#include <cstdint>
+#include <string>
+
+enum reason_code : uint8_t {
+	R_UNKNOWN,
+	R_STALE,
+	R_BLOCKED,
+	R_NOW_STARTING,
+	R_ALREADY_STARTING,
+	R_ALREADY_STARTED,
+	R_CURRENTLY_STOPPING,
+	R_CURRENTLY_RESTARTING,
+	R_WAIT_READY,
+	R_WAIT_SETTLE,
+	R_ALREADY_STOPPED,
+	R_CURRENTLY_STARTING,
+	R_NOW_STOPPING,
+	R_ALREADY_STOPPING,
+	R_WAIT_STOPPED,
+	R_RESTART_CANCELLED,
+	R_START_LIMIT,
+	R_PRESSURE,
+};
+
+inline std::string reason_text(reason_code code, const std::string& other) {
+	switch (code) {
+		case R_UNKNOWN:              return "?";
+		case R_STALE:                return "stale unit";
+		case R_BLOCKED:              return "unit blocked";
+		case R_NOW_STARTING:         return "now starting";
+		case R_ALREADY_STARTING:     return "already starting";
+		case R_ALREADY_STARTED:      return "already started";
+		case R_CURRENTLY_STOPPING:   return "currently stopping";
+		case R_CURRENTLY_RESTARTING: return "currently restarting";
+		case R_WAIT_READY:           return "waiting for " + other + " to be ready";
+		case R_WAIT_SETTLE:          return "settle: waiting for " + other + " to go down";
+		case R_ALREADY_STOPPED:      return "already stopped";
+		case R_CURRENTLY_STARTING:   return "currently starting";
+		case R_NOW_STOPPING:         return "now stopping";
+		case R_ALREADY_STOPPING:     return "already stopping";
+		case R_WAIT_STOPPED:         return "waiting for " + other + " to stop running";
+		case R_RESTART_CANCELLED:    return "restart cancelled";
+		case R_START_LIMIT:          return "start limit reached";
+		case R_PRESSURE:             return "deferred due to resource pressure";
+	}
+	return "?";
+}
+
+enum script_kind : uint8_t { S_LOGROT, S_START, S_RUN, S_READY, S_STOP, S_RESTART, S_EVENT, S_OTHER, S_HEALTH };
+
+inline script_kind script_kind_of(const std::string& script) {
+	if (script == "logrotate"             ) return S_LOGROT ;
+	if (script == "start"                 ) return S_START  ;
+	if (script == "run"                   ) return S_RUN    ;
+	if (script == "ready"                 ) return S_READY  ;
+	if (script == "stop"                  ) return S_STOP   ;
+	if (script == "restart"               ) return S_RESTART;
+	if (script == "health"                ) return S_HEALTH ;
+	if (script.compare(0, 7, "events/") == 0) return S_EVENT  ;
+	                                        return S_OTHER  ;
+}
+
+inline std::string script_kind_name(script_kind kind) {
+	switch (kind) {
+		case S_LOGROT:  return "logrotate";
+		case S_START:   return "start"    ;
+		case S_RUN:     return "run"      ;
+		case S_READY:   return "ready"    ;
+		case S_STOP:    return "stop"     ;
+		case S_RESTART: return "restart"  ;
+		case S_EVENT:   return "event"    ;
+		case S_OTHER:   return "other"    ;
+		case S_HEALTH:  return "health"   ;
+	}
+	return "?";
+}
+
+// internal unit states, in the order of unit::state_t
+static const char* const flightrec_states[] = { "DOWN", "IN_LOGROT", "IN_START", "IN_RDY", "UP", "IN_RDY_ERR", "IN_RUN", "IN_STOP", "IN_RESTART" };
+
+enum flightrec_type : uint8_t { FR_STATE, FR_QUEUE, FR_SPAWN, FR_EXIT, FR_SIGNAL };
+
+static const uint32_t flightrec_none    = UINT32_MAX;
+static const uint32_t flightrec_magic   = 0x52465357; // "WSFR"
+static const uint32_t flightrec_version = 1;
+
+// File layout: header, then header.names strings (uint16_t length + bytes), then header.records records in
+// chronological order.
+
+struct flightrec_header {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t started;   // monotonic time of the wsunitd start, ns
+	uint64_t dumped;    // monotonic time of the dump, ns
+	uint32_t names;
+	uint32_t records;
+};
+
+struct flightrec_record {
+	uint64_t time;      // monotonic, ns
+	uint32_t unit;      // index into the name table, or flightrec_none
+	uint32_t other;     // unit the reason refers to, or flightrec_none
+	int32_t  pid;
+	int32_t  value;     // FR_EXIT: wait status, FR_SIGNAL: signal number
+	uint8_t  type;      // flightrec_type
+	uint8_t  a;         // FR_STATE: old state, FR_QUEUE: 0 = start / 1 = stop queue, FR_SPAWN / FR_EXIT: script_kind
+	uint8_t  b;         // FR_STATE: new state, FR_QUEUE: reason_code
+	uint8_t  keep;      // FR_QUEUE: unit was kept in the queue
+	uint8_t  pad[4];
+};
+
+static_assert(sizeof(flightrec_record) == 32, "flight recorder records must stay compact");
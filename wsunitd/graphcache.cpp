@@ -0,0 +1,244 @@
+#include "wsunitd.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+
+// The dependency declarations of all units are kept in memory together with the inode number and mtime of every
+// directory they were read from, and persisted in `WSUNIT_STATE_DIR/graph.cache`. A refresh only lists the directories
+// whose stamp changed; with an unchanged config dir, not even the config dir itself is listed.
+//
+// File format, all integers in host byte order:
+//
+//     "wsgraph1" <confdir stamp> <u32 unit count>
+//     per unit: <str name> <u8 dir> <5 stamps> <4 string lists: u32 count, <str>...>
+//
+// with a stamp being <u64 ino> <i64 sec> <i64 nsec> and a str <u16 length> <bytes>.
+
+static const char cache_magic[8] = { 'w', 's', 'g', 'r', 'a', 'p', 'h', '1' };
+
+// directories modified this recently might change again within the same timestamp, so they are neither trusted nor
+// saved to the cache
+static const int64_t cache_settle = 2;
+
+bool depgraph::settled(const stamp& s) { return s.sec < time(0) - cache_settle; }
+
+map<string, depgraph::decl> depgraph::decls;
+set<string>                 depgraph::listed;
+depgraph::stamp             depgraph::listed_stamp;
+bool                        depgraph::cache_partial;
+
+depgraph::stamp depgraph::stamp_of(const path& p, bool* is_dir) {
+	struct stat st;
+	if (stat(p.c_str(), &st) == -1 || !S_ISDIR(st.st_mode)) {
+		if (is_dir) *is_dir = false;
+		return stamp();
+	}
+	if (is_dir) *is_dir = true;
+	return stamp{ (uint64_t) st.st_ino, st.st_mtim.tv_sec, st.st_mtim.tv_nsec };
+}
+
+bool depgraph::stamp::operator==(const stamp& o) const { return ino == o.ino && sec == o.sec && nsec == o.nsec; }
+
+const char* const depgraph::decl_dirs[4] = { "deps", "revdeps", "socket-deps", "socket-revdeps" };
+
+depgraph::decl depgraph::read_decl(const string& name) {
+	decl d;
+	path p = confdir / name;
+	d.stamps[0] = stamp_of(p, &d.dir);
+	if (!d.dir) return d;
+
+	for (int i = 0; i < 4; ++i) {
+		d.stamps[i + 1] = stamp_of(p / decl_dirs[i]);
+		if (d.stamps[i + 1].ino)
+			for (directory_entry& e : directory_iterator(p / decl_dirs[i]))
+				d.names[i].insert(e.path().filename().string());
+	}
+	return d;
+}
+
+bool depgraph::fresh(const string& name, const decl& d) {
+	path p = confdir / name;
+	bool dir;
+	if (!(stamp_of(p, &dir) == d.stamps[0]) || dir != d.dir || !settled(d.stamps[0])) return false;
+	if (!dir) return true;
+
+	for (int i = 0; i < 4; ++i)
+		if (!(stamp_of(p / decl_dirs[i]) == d.stamps[i + 1]) || !settled(d.stamps[i + 1])) return false;
+	return true;
+}
+
+bool depgraph::scan(void) {
+	size_t stale = 0;
+
+	stamp cs = stamp_of(confdir);
+	if (!(cs == listed_stamp) || cs.ino == 0 || !settled(cs)) {
+		listed.clear();
+		for (directory_entry& d : directory_iterator(confdir)) listed.insert(d.path().filename().string());
+		listed_stamp = cs;
+		stale++;
+	}
+
+	filter(decls, [](auto& e) { return listed.count(e.first) > 0; });
+	for (auto& n : listed) {
+		auto it = decls.find(n);
+		if (it != decls.end() && fresh(n, it->second)) continue;
+		decls[n] = read_decl(n);
+		stale++;
+	}
+
+	LOG_DEBUG("graph scan: " + to_string(listed.size()) + " units, " + to_string(stale) + " directories rescanned");
+	return stale > 0;
+}
+
+bool depgraph::declared(const string& name, int kind, const string& other) {
+	auto it = decls.find(name);
+	if (it == decls.end() && (it = instances.find(name)) == instances.end()) return false;
+	return it->second.names[kind].count(other) > 0;
+}
+
+bool depgraph::is_unit_dir(const string& name) {
+	if (instances.count(name)) return true;
+	auto it = decls.find(name);
+	return it != decls.end() && it->second.dir && !unit::is_template(name);
+}
+
+namespace {
+	struct reader {
+		const char* p;
+		const char* end;
+		bool        ok = true;
+
+		template <class T> T get(void) {
+			T v = T();
+			if (end - p < (ptrdiff_t) sizeof(T)) { ok = false; p = end; return v; }
+			memcpy(&v, p, sizeof(T));
+			p += sizeof(T);
+			return v;
+		}
+
+		string str(void) {
+			uint16_t l = get<uint16_t>();
+			if (end - p < l) { ok = false; p = end; return ""; }
+			string s(p, l);
+			p += l;
+			return s;
+		}
+	};
+
+	template <class T> void put(string& buf, T v) { buf.append((const char*) &v, sizeof(T)); }
+	void put_str(string& buf, const string& s) { put<uint16_t>(buf, s.size()); buf += s; }
+}
+
+void depgraph::load_cache(void) {
+	path p = statedir / "graph.cache";
+	int fd = open(p.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd == -1) return;
+
+	struct stat st;
+	if (fstat(fd, &st) == -1 || st.st_size == 0) {
+		close(fd);
+		return;
+	}
+
+	void* m = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (m == MAP_FAILED) {
+		log::warn("could not map " + p.string() + ": " + strerror(errno));
+		return;
+	}
+
+	reader r{ (const char*) m, (const char*) m + st.st_size };
+	map<string, decl> ds;
+	set<string>       ls;
+	stamp             cs;
+
+	if (st.st_size < (off_t) sizeof(cache_magic) || memcmp(r.p, cache_magic, sizeof(cache_magic)) != 0) r.ok = false;
+	else {
+		r.p += sizeof(cache_magic);
+		cs.ino = r.get<uint64_t>();
+		cs.sec = r.get<int64_t>();
+		cs.nsec = r.get<int64_t>();
+
+		uint32_t n = r.get<uint32_t>();
+		for (uint32_t i = 0; i < n && r.ok; ++i) {
+			string name = r.str();
+			decl&  d    = ds[name];
+			d.dir = r.get<uint8_t>();
+			for (auto& s : d.stamps) {
+				s.ino  = r.get<uint64_t>();
+				s.sec  = r.get<int64_t>();
+				s.nsec = r.get<int64_t>();
+			}
+			for (auto& names : d.names) {
+				uint32_t c = r.get<uint32_t>();
+				for (uint32_t j = 0; j < c && r.ok; ++j) names.insert(r.str());
+			}
+			ls.insert(name);
+		}
+	}
+
+	munmap(m, st.st_size);
+
+	if (!r.ok) {
+		log::warn(p.string() + " is corrupt, scanning all units");
+		return;
+	}
+
+	decls        = ds;
+	listed       = ls;
+	listed_stamp = cs;
+	log::note("loaded graph cache with " + to_string(decls.size()) + " units");
+}
+
+void depgraph::save_cache(void) {
+	string buf(cache_magic, sizeof(cache_magic));
+
+	vector<const pair<const string, decl>*> keep;
+	for (auto& e : decls) {
+		bool ok = true;
+		for (auto& s : e.second.stamps) ok = ok && settled(s);
+		if (ok) keep.push_back(&e);
+	}
+
+	// the units are listed from the cache only if it has all of them, otherwise the config dir is listed again next
+	// time, and the units are still taken from the cache where they are in it
+	stamp cs = settled(listed_stamp) && keep.size() == decls.size() ? listed_stamp : stamp();
+	put(buf, cs.ino);
+	put(buf, cs.sec);
+	put(buf, cs.nsec);
+
+	// whatever is left out now is saved by a later refresh
+	cache_partial = keep.size() < decls.size() || !(cs == listed_stamp);
+
+	put<uint32_t>(buf, keep.size());
+	for (auto e : keep) {
+		put_str(buf, e->first);
+		put<uint8_t>(buf, e->second.dir);
+		for (auto& s : e->second.stamps) {
+			put(buf, s.ino);
+			put(buf, s.sec);
+			put(buf, s.nsec);
+		}
+		for (auto& names : e->second.names) {
+			put<uint32_t>(buf, names.size());
+			for (auto& n : names) put_str(buf, n);
+		}
+	}
+
+	path p = statedir / "graph.cache";
+	path t = p.string() + ".tmp";
+	int fd = open(t.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd == -1) {
+		log::warn("could not write " + t.string() + ": " + strerror(errno));
+		return;
+	}
+	bool ok = write(fd, buf.data(), buf.size()) == (ssize_t) buf.size();
+	close(fd);
+
+	boost::system::error_code ec;
+	if (ok) rename(t, p, ec);
+	if (!ok || ec) log::warn("could not write " + p.string());
+}
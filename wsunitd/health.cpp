@@ -0,0 +1,206 @@
+#include "wsunitd.hpp"
+
+#include <fstream>
+
+#include <signal.h>
+#include <sys/wait.h>
+
+
+
+// While a unit is ready, an executable `health` script or a `health-probe` (see probe.cpp) is run every `<interval>`
+// seconds as configured in `health-check` (`<interval> [<timeout> [<failures>]]`, default `10 5 3`). A check that
+// fails or runs for longer than `<timeout>` seconds counts as failed; after `<failures>` failures in a row the unit is
+// stopped like a unit whose run script exited, which restarts it if it is still needed.
+
+bool unit::has_health(void) {
+	auto p = dir() / "health";
+	return (is_regular_file(p) && access(p.c_str(), X_OK) == 0) || is_regular_file(dir() / "health-probe");
+}
+
+const unit::health_stats& unit::health(void) { return health_; }
+
+void unit::health_config(double& interval, double& timeout, unsigned& failures) {
+	interval = 10;
+	timeout  = 5;
+	failures = 3;
+
+	path p = config_file("health-check");
+	if (p.empty()) return;
+
+	std::ifstream in(p);
+	if (!(in >> interval) || interval <= 0) {
+		log::warn(term_name() + ": could not parse " + p.string() + ", expected \"<interval> [<timeout> [<failures>]]\"");
+		interval = 10;
+	}
+	else if (in >> timeout) in >> failures;
+
+	if (failures == 0) failures = 1;
+}
+
+void unit::arm_health(void) {
+	double interval, timeout;
+	unsigned failures;
+	health_config(interval, timeout, failures);
+
+	weak_ptr<unit> w = shared_from_this();
+	health_timer = timer::add(interval * 1e9, [w]{
+		with_weak_ptr(w, false, [](shared_ptr<unit> u) {
+			u->health_timer = 0;
+			if (u->state == UP) u->run_health();
+			return true;
+		});
+	});
+}
+
+void unit::run_health(void) {
+	double interval, timeout;
+	unsigned failures;
+	health_config(interval, timeout, failures);
+
+	health_started  = monotime();
+	health_timedout = false;
+
+	weak_ptr<unit> w = shared_from_this();
+	health_timeout = timer::add(timeout * 1e9, [w]{
+		with_weak_ptr(w, false, [](shared_ptr<unit> u) {
+			u->health_timeout  = 0;
+			u->health_timedout = true;
+			if (u->health_pid) {
+				LOG_DEBUG(u->term_name() + ": health script timed out, kill(-" + to_string(u->health_pid) + ", " + signal_string(SIGKILL) + ")");
+				u->kill_script("health", u->health_pid, SIGKILL);
+			}
+			else if (u->health_probe) {
+				u->health_probe.reset();
+				u->on_health(false, "timed out");
+			}
+			return true;
+		});
+	});
+
+	if (is_regular_file(dir() / "health-probe")) {
+		string spec;
+		getline(std::ifstream((dir() / "health-probe").string()), spec);
+
+		try {
+			health_probe = make_probe(spec, 0, [w](bool ok, const string& why) {
+				with_weak_ptr(w, false, [ok, &why](shared_ptr<unit> u) {
+					u->health_probe.reset();
+					u->on_health(ok, why);
+					return true;
+				});
+			});
+		}
+		catch (exception& ex) {
+			on_health(false, "invalid health probe \"" + spec + "\": " + ex.what());
+			return;
+		}
+
+		// keep the probe alive if it finishes right away
+		auto pr = health_probe;
+		run_probe(pr);
+		return;
+	}
+
+	pid_t pid = fork_();
+	if (pid == 0) {
+		if (chdir(dir().c_str()) == -1) {
+			log::err("failed to chdir to " + dir().string() + ": " + strerror(errno));
+			exit(1);
+		}
+		pid_t sid = setsid();
+		if (sid == -1) {
+			log::err(string("failed to run setsid: ") + strerror(errno));
+			exit(1);
+		}
+		cgroup::enter(name(), "health");
+		instance_env();
+		LOG_DEBUG(string("fork health as pid ") + to_string(getpid()) + " sid " + to_string(sid));
+		output_logfile(name() + ".log");
+		execl((dir() / "health").c_str(), (dir() / "health").c_str(), (char*) NULL);
+		exit(1);
+	}
+	else if (pid > 0) {
+		term_add(pid, on_health_exit, shared_from_this(), "health");
+		health_pid = pid;
+	}
+	else
+		on_health(false, string("could not fork: ") + strerror(errno));
+}
+
+void unit::stop_health(void) {
+	if (health_timer) {
+		timer::cancel(health_timer);
+		health_timer = 0;
+	}
+	if (health_timeout) {
+		timer::cancel(health_timeout);
+		health_timeout = 0;
+	}
+	if (health_pid) {
+		kill_script("health", health_pid, SIGKILL);
+		health_pid = 0;
+	}
+	health_probe.reset();
+	health_.failing = 0;
+}
+
+void unit::on_health(bool ok, const string& why) {
+	if (health_timeout) {
+		timer::cancel(health_timeout);
+		health_timeout = 0;
+	}
+
+	double interval, timeout;
+	unsigned failures;
+	health_config(interval, timeout, failures);
+
+	health_.checks++;
+	health_.latency = monotime() - health_started;
+	if (ok) health_.failing = 0;
+	else {
+		health_.failures++;
+		health_.failing++;
+		log::warn(term_name() + ": health check failed (" + to_string(health_.failing) + "/" + to_string(failures) + "): " + why);
+	}
+
+	std::ofstream(statedir / "health" / name_)
+		<< (health_.failing ? "failing" : "healthy") << "\t" << health_.failing << "\t" << health_.latency / 1e9 << "\t"
+		<< health_.checks << "\t" << health_.failures << "\t" << health_.stops << endl;
+
+	if (state != UP) return;
+
+	if (health_.failing >= failures) {
+		log::warn(term_name() + ": unhealthy, stopping");
+		health_.stops++;
+		stop_health();
+		step_active_run();
+		depgraph::queue_step();
+		return;
+	}
+
+	arm_health();
+}
+
+#pragma GCC diagnostic push
+	#pragma GCC diagnostic ignored "-Wunused-parameter"
+
+	void unit::on_health_exit(pid_t pid, shared_ptr<unit> u, int status) {
+		u->record_exit("health", status);
+
+		// a check interrupted by the unit going down is not reported
+		if (pid != u->health_pid) return;
+
+		u->kill_script("health", pid, SIGTERM);
+		u->health_pid = 0;
+
+		if (u->health_timedout)
+			u->on_health(false, "timed out");
+		else if (!WIFEXITED(status))
+			u->on_health(false, "terminated by signal " + signal_string(WTERMSIG(status)));
+		else if (WEXITSTATUS(status) != 0)
+			u->on_health(false, "exited with code " + to_string(WEXITSTATUS(status)));
+		else
+			u->on_health(true, "");
+	}
+
+#pragma GCC diagnostic pop
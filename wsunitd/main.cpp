@@ -5,31 +5,18 @@
 
 
 
-path confdir ;
-path statedir;
-path logdir  ;
-bool in_shutdown;
-
-
-
-void mkdirs(void) {
-	if (!is_directory(confdir              )) create_directories(confdir              );
-	if (!is_directory(confdir / "@default" )) create_directories(confdir / "@default" );
-	if (!is_directory(confdir / "@shutdown")) create_directories(confdir / "@shutdown");
-	if (!is_directory(statedir             )) create_directories(statedir             );
-	if (!is_directory(statedir / "wanted"  )) create_directories(statedir / "wanted"  );
-	if (!is_directory(statedir / "masked"  )) create_directories(statedir / "masked"  );
-	if (!is_directory(statedir / "state"   )) create_directories(statedir / "state"   );
-	if (!is_directory(statedir / "pid"     )) create_directories(statedir / "pid"     );
-	if (!is_directory(logdir               )) create_directories(logdir               );
-}
-
 int main(int argc, char** argv) {
 	char* tmp;
 
+	started_at = monotime();
+	reexec::init(argv);
+
 	tmp = getenv("WSUNIT_VERBOSE");
 	log::verbose = tmp && *tmp;
 
+	tmp = getenv("WSUNIT_TRACE");
+	if (tmp && *tmp) trace::open(tmp);
+
 	tmp = getenv("WSUNIT_CONFIG_DIR");
 	if (!tmp) {
 		log::fatal("WSUNIT_CONFIG_DIR environment variable is not set");
@@ -52,10 +39,14 @@ int main(int argc, char** argv) {
 	logdir = tmp;
 
 	mkdirs();
-	remove(logdir / "_");
+	if (!reexec::load()) remove(logdir / "_");
 	output_logfile("_");
 
+	tmp = getenv("WSUNIT_CGROUP");
+	if (tmp && *tmp) cgroup::init(tmp);
+
 	depgraph::refresh();
+	reexec::finish();
 	std::ofstream(statedir / "wsunitd.pid") << getpid() << endl;
 	depgraph::start_stop_units();
 
@@ -0,0 +1,212 @@
+#include "wsunitd.hpp"
+
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+
+
+
+void metrics::write(void) {
+	replace(statedir / "metrics", render       ());
+	replace(statedir / "timing" , render_timing());
+
+	// the usage of a unit only changes when one of its scripts exits
+	for (auto& u : depgraph::get_units())
+		if (u->usage_changed()) replace(statedir / "usage" / u->name(), render_usage(u));
+}
+
+void metrics::replace(const path& p, const string& content) {
+	path t = p.string() + ".tmp";
+
+	{
+		std::ofstream out(t);
+		out << content;
+		if (!out) {
+			log::warn("could not write " + t.string());
+			return;
+		}
+	}
+
+	boost::system::error_code ec;
+	rename(t, p, ec);
+	if (ec) log::warn("could not replace " + p.string() + ": " + ec.message());
+}
+
+string metrics::render(void) {
+	auto units = depgraph::get_units();
+	stringstream ss;
+	ss << fixed << setprecision(6);
+
+	ss << "# HELP wsunit_unit_state Current internal state of the unit.\n";
+	ss << "# TYPE wsunit_unit_state gauge\n";
+	for (auto& u : units)
+		for (int s = 0; s < unit::n_states; ++s)
+			ss << "wsunit_unit_state{unit=\"" << escape(u->name()) << "\",state=\"" << unit::state_name((unit::state_t) s) << "\"} "
+			   << (u->get_state() == s ? 1 : 0) << "\n";
+
+	ss << "# HELP wsunit_unit_state_entered_total Number of transitions into the internal state.\n";
+	ss << "# TYPE wsunit_unit_state_entered_total counter\n";
+	for (auto& u : units)
+		for (int s = 0; s < unit::n_states; ++s)
+			ss << "wsunit_unit_state_entered_total{unit=\"" << escape(u->name()) << "\",state=\"" << unit::state_name((unit::state_t) s) << "\"} "
+			   << u->state_count((unit::state_t) s) << "\n";
+
+	ss << "# HELP wsunit_unit_state_seconds_total Time spent in the internal state, including the current stay.\n";
+	ss << "# TYPE wsunit_unit_state_seconds_total counter\n";
+	for (auto& u : units)
+		for (int s = 0; s < unit::n_states; ++s)
+			ss << "wsunit_unit_state_seconds_total{unit=\"" << escape(u->name()) << "\",state=\"" << unit::state_name((unit::state_t) s) << "\"} "
+			   << u->state_duration((unit::state_t) s) / 1e9 << "\n";
+
+	ss << "# HELP wsunit_unit_restarts_total Number of times the unit entered the restart phase.\n";
+	ss << "# TYPE wsunit_unit_restarts_total counter\n";
+	for (auto& u : units)
+		ss << "wsunit_unit_restarts_total{unit=\"" << escape(u->name()) << "\"} " << u->state_count(unit::IN_RESTART) << "\n";
+
+	ss << "# HELP wsunit_unit_scheduled_starts_total Number of scheduled starts, by whether they were carried out or skipped.\n";
+	ss << "# TYPE wsunit_unit_scheduled_starts_total counter\n";
+	for (auto& u : units) {
+		ss << "wsunit_unit_scheduled_starts_total{unit=\"" << escape(u->name()) << "\",result=\"fired\"} "   << u->schedule_counts().fired   << "\n";
+		ss << "wsunit_unit_scheduled_starts_total{unit=\"" << escape(u->name()) << "\",result=\"skipped\"} " << u->schedule_counts().skipped << "\n";
+	}
+
+	ss << "# HELP wsunit_unit_health_checks_total Number of health checks, by result.\n";
+	ss << "# TYPE wsunit_unit_health_checks_total counter\n";
+	for (auto& u : units) {
+		ss << "wsunit_unit_health_checks_total{unit=\"" << escape(u->name()) << "\",result=\"ok\"} "     << u->health().checks - u->health().failures << "\n";
+		ss << "wsunit_unit_health_checks_total{unit=\"" << escape(u->name()) << "\",result=\"failed\"} " << u->health().failures                   << "\n";
+	}
+
+	ss << "# HELP wsunit_unit_health_check_seconds Duration of the last health check.\n";
+	ss << "# TYPE wsunit_unit_health_check_seconds gauge\n";
+	for (auto& u : units)
+		ss << "wsunit_unit_health_check_seconds{unit=\"" << escape(u->name()) << "\"} " << u->health().latency / 1e9 << "\n";
+
+	ss << "# HELP wsunit_unit_health_stops_total Number of times the unit was stopped after failing its health checks.\n";
+	ss << "# TYPE wsunit_unit_health_stops_total counter\n";
+	for (auto& u : units)
+		ss << "wsunit_unit_health_stops_total{unit=\"" << escape(u->name()) << "\"} " << u->health().stops << "\n";
+
+	ss << "# HELP wsunit_pressure_throttled Whether unit starts are currently throttled due to resource pressure.\n";
+	ss << "# TYPE wsunit_pressure_throttled gauge\n";
+	ss << "wsunit_pressure_throttled " << (pressure::throttled() ? 1 : 0) << "\n";
+
+	ss << "# HELP wsunit_pressure_events_total Number of PSI trigger notifications, by resource.\n";
+	ss << "# TYPE wsunit_pressure_events_total counter\n";
+	for (auto& [r, n] : pressure::events())
+		ss << "wsunit_pressure_events_total{resource=\"" << escape(r) << "\"} " << n << "\n";
+
+	ss << "# HELP wsunit_unit_pressure_deferred_total Number of periods of pressure during which the unit's start was deferred.\n";
+	ss << "# TYPE wsunit_unit_pressure_deferred_total counter\n";
+	for (auto& u : units) {
+		auto it = pressure::deferred().find(u->name());
+		ss << "wsunit_unit_pressure_deferred_total{unit=\"" << escape(u->name()) << "\"} " << (it == pressure::deferred().end() ? 0 : it->second) << "\n";
+	}
+
+	if (cgroup::enabled()) {
+		ss << "# HELP wsunit_unit_cgroup_populated Whether any process of the unit is left in its cgroup.\n";
+		ss << "# TYPE wsunit_unit_cgroup_populated gauge\n";
+		for (auto& u : units)
+			ss << "wsunit_unit_cgroup_populated{unit=\"" << escape(u->name()) << "\"} " << (cgroup::populated(u->name()) ? 1 : 0) << "\n";
+
+		ss << "# HELP wsunit_unit_memory_bytes Memory used by the processes of the unit (memory.current).\n";
+		ss << "# TYPE wsunit_unit_memory_bytes gauge\n";
+		for (auto& u : units)
+			ss << "wsunit_unit_memory_bytes{unit=\"" << escape(u->name()) << "\"} " << cgroup::memory(u->name()) << "\n";
+
+		ss << "# HELP wsunit_unit_cpu_seconds_total CPU time used by the processes of the unit (cpu.stat usage_usec).\n";
+		ss << "# TYPE wsunit_unit_cpu_seconds_total counter\n";
+		for (auto& u : units)
+			ss << "wsunit_unit_cpu_seconds_total{unit=\"" << escape(u->name()) << "\"} " << cgroup::cpu_usec(u->name()) / 1e6 << "\n";
+	}
+
+	ss << "# HELP wsunit_unit_script_runs_total Number of script executions that terminated.\n";
+	ss << "# TYPE wsunit_unit_script_runs_total counter\n";
+	for (auto& u : units)
+		for (auto& [script, e] : u->exits())
+			ss << "wsunit_unit_script_runs_total{unit=\"" << escape(u->name()) << "\",script=\"" << escape(script) << "\"} " << e.runs << "\n";
+
+	ss << "# HELP wsunit_unit_script_failures_total Number of script executions that exited with an error or signal.\n";
+	ss << "# TYPE wsunit_unit_script_failures_total counter\n";
+	for (auto& u : units)
+		for (auto& [script, e] : u->exits())
+			ss << "wsunit_unit_script_failures_total{unit=\"" << escape(u->name()) << "\",script=\"" << escape(script) << "\"} " << e.failures << "\n";
+
+	ss << "# HELP wsunit_unit_script_timeouts_total Number of script executions that were killed after exceeding their timeout.\n";
+	ss << "# TYPE wsunit_unit_script_timeouts_total counter\n";
+	for (auto& u : units)
+		for (auto& [script, e] : u->exits())
+			ss << "wsunit_unit_script_timeouts_total{unit=\"" << escape(u->name()) << "\",script=\"" << escape(script) << "\"} " << e.timeouts << "\n";
+
+	ss << "# HELP wsunit_unit_script_last_exit_status Exit code of the last execution, 128 + signal number if killed.\n";
+	ss << "# TYPE wsunit_unit_script_last_exit_status gauge\n";
+	for (auto& u : units)
+		for (auto& [script, e] : u->exits())
+			ss << "wsunit_unit_script_last_exit_status{unit=\"" << escape(u->name()) << "\",script=\"" << escape(script) << "\"} " << e.last_status << "\n";
+
+	ss << "# HELP wsunit_unit_script_cpu_seconds_total CPU time used by the scripts of the unit and the children they waited for.\n";
+	ss << "# TYPE wsunit_unit_script_cpu_seconds_total counter\n";
+	for (auto& u : units)
+		for (auto& [kind, r] : u->usage()) {
+			ss << "wsunit_unit_script_cpu_seconds_total{unit=\"" << escape(u->name()) << "\",kind=\"" << kind << "\",mode=\"user\"} "   << r.utime << "\n";
+			ss << "wsunit_unit_script_cpu_seconds_total{unit=\"" << escape(u->name()) << "\",kind=\"" << kind << "\",mode=\"system\"} " << r.stime << "\n";
+		}
+
+	ss << "# HELP wsunit_unit_script_max_rss_bytes Largest resident set size of any script execution.\n";
+	ss << "# TYPE wsunit_unit_script_max_rss_bytes gauge\n";
+	for (auto& u : units)
+		for (auto& [kind, r] : u->usage())
+			ss << "wsunit_unit_script_max_rss_bytes{unit=\"" << escape(u->name()) << "\",kind=\"" << kind << "\"} " << r.maxrss * 1024 << "\n";
+
+	ss << "# HELP wsunit_unit_script_block_io_total Block I/O operations of the scripts.\n";
+	ss << "# TYPE wsunit_unit_script_block_io_total counter\n";
+	for (auto& u : units)
+		for (auto& [kind, r] : u->usage()) {
+			ss << "wsunit_unit_script_block_io_total{unit=\"" << escape(u->name()) << "\",kind=\"" << kind << "\",direction=\"in\"} "  << r.inblock << "\n";
+			ss << "wsunit_unit_script_block_io_total{unit=\"" << escape(u->name()) << "\",kind=\"" << kind << "\",direction=\"out\"} " << r.oublock << "\n";
+		}
+
+	ss << "# HELP wsunit_unit_script_context_switches_total Context switches of the scripts.\n";
+	ss << "# TYPE wsunit_unit_script_context_switches_total counter\n";
+	for (auto& u : units)
+		for (auto& [kind, r] : u->usage()) {
+			ss << "wsunit_unit_script_context_switches_total{unit=\"" << escape(u->name()) << "\",kind=\"" << kind << "\",type=\"voluntary\"} "   << r.nvcsw  << "\n";
+			ss << "wsunit_unit_script_context_switches_total{unit=\"" << escape(u->name()) << "\",kind=\"" << kind << "\",type=\"involuntary\"} " << r.nivcsw << "\n";
+		}
+
+	return ss.str();
+}
+
+string metrics::render_timing(void) {
+	stringstream ss;
+
+	ss << "phase\t" << (in_shutdown ? "shutdown" : "default") << "\n";
+	ss << "daemon\t" << started_at << "\t" << monotime() << "\n";
+
+	for (auto& u : depgraph::get_units()) {
+		auto& t = u->timing();
+		ss << "unit\t" << u->name() << "\t" << t.queued << "\t" << t.startable << "\t" << t.started << "\t" << t.ready << "\t" << t.blocker << "\n";
+	}
+
+	return ss.str();
+}
+
+string metrics::render_usage(shared_ptr<unit> u) {
+	stringstream ss;
+	for (auto& [k, r] : u->usage())
+		ss << k << "\t" << r.runs << "\t" << r.utime << "\t" << r.stime << "\t" << r.maxrss << "\t"
+		   << r.inblock << "\t" << r.oublock << "\t" << r.nvcsw << "\t" << r.nivcsw << "\n";
+	return ss.str();
+}
+
+string metrics::escape(const string& s) {
+	string ret;
+	for (char c : s)
+		switch (c) {
+			case '\\': ret += "\\\\"; break;
+			case '"' : ret += "\\\""; break;
+			case '\n': ret += "\\n" ; break;
+			default  : ret += c     ; break;
+		}
+	return ret;
+}
@@ -0,0 +1,158 @@
+#include "wsunitd.hpp"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+
+
+
+// With a `ready-notify` file, the run script inherits the write end of a pipe as WSUNIT_NOTIFY_FD and the unit is up
+// as soon as a line reading `ready` arrives on it. If the pipe is closed without that line, the ready probe or script
+// (if any) takes over. The read end stays open until run exits, so services writing more lines do not get SIGPIPE.
+
+class notify_handler : public epoll_handler {
+	public:
+		notify_handler(int fd, weak_ptr<unit> u) : u(u) { this->fd = fd; }
+
+		void handle(void) override {
+			char buf[PIPE_BUF];
+			ssize_t n;
+			while ((n = read(fd, buf, sizeof(buf))) > 0)
+				for (ssize_t i = 0; i < n; ++i) {
+					if (buf[i] != '\n') {
+						if (line.size() < PIPE_BUF) line += buf[i];
+						continue;
+					}
+
+					string l;
+					swap(l, line);
+					with_weak_ptr(u, false, [&l](shared_ptr<unit> u) { u->on_notify(l); return true; });
+				}
+
+			if (n == 0)
+				with_weak_ptr(u, false, [](shared_ptr<unit> u) { u->on_notify_eof(); return true; });
+			else if (errno != EAGAIN && errno != EWOULDBLOCK)
+				log::warn(string("reading notify fd failed: ") + strerror(errno));
+		}
+
+	private:
+		weak_ptr<unit> u;
+		string         line;
+};
+
+bool unit::has_notify(void) { return is_regular_file(dir() / "ready-notify"); }
+
+void unit::open_notify(void) {
+	int fds[2];
+	if (pipe2(fds, O_CLOEXEC) == -1) {
+		log::warn(term_name() + ": could not create notify pipe, falling back to the ready script: " + strerror(errno));
+		return;
+	}
+	fcntl(fds[0], F_SETFL, O_NONBLOCK);
+
+	try {
+		epoll_add(make_shared<notify_handler>(fds[0], shared_from_this()));
+	}
+	catch (exception& ex) {
+		log::warn(term_name() + ": " + ex.what() + ", falling back to the ready script");
+		close(fds[1]);
+		return;
+	}
+
+	notify_fd = fds[0];
+	notify_w  = fds[1];
+}
+
+// The read end of a pipe inherited across a re-exec, the write end is only held by the run script.
+void unit::adopt_notify(int fd) {
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+	try {
+		epoll_add(make_shared<notify_handler>(fd, shared_from_this()));
+		notify_fd = fd;
+	}
+	catch (exception& ex) {
+		log::warn(term_name() + ": " + ex.what());
+	}
+}
+
+// Called in the forked run script, before pass_sockets: the fd is moved above the range taken by the sockets.
+void unit::pass_notify(void) {
+	if (notify_w == -1) return;
+
+	int fd = fcntl(notify_w, F_DUPFD, 3 + (int) sockets.size());
+	if (fd == -1) {
+		log::err(term_name() + ": could not pass notify fd: " + strerror(errno));
+		exit(1);
+	}
+	setenv("WSUNIT_NOTIFY_FD", to_string(fd).c_str(), 1);
+}
+
+void unit::close_notify(void) {
+	if (notify_w != -1) {
+		close(notify_w);
+		notify_w = -1;
+	}
+
+	if (notify_fd == -1) return;
+	epoll_del(notify_fd);
+	notify_fd = -1;
+
+	if (state == IN_RDY && rdy_pid == 0 && timeout_timer) {
+		timer::cancel(timeout_timer);
+		timeout_timer = 0;
+	}
+}
+
+void unit::wait_notify(void) {
+	log::note(term_name() + ": wait for ready notification");
+	wait_ready("ready notification");
+}
+
+void unit::on_notify(const string& line) {
+	if (line != "ready") {
+		LOG_DEBUG(term_name() + ": ignore notification \"" + line + "\"");
+		return;
+	}
+
+	if (state != IN_RDY) {
+		LOG_DEBUG(term_name() + ": ignore ready notification in state " + state_name(state));
+		return;
+	}
+
+	log::note(term_name() + ": received ready notification");
+
+	if (timeout_timer) {
+		timer::cancel(timeout_timer);
+		timeout_timer = 0;
+	}
+
+	// the fallback ready script is no longer needed, its exit is ignored since rdy_pid does not match anymore
+	if (rdy_pid) {
+		LOG_DEBUG(term_name() + ": kill(-" + to_string(rdy_pid) + ", " + signal_string(SIGTERM) + ")");
+		kill_script("ready", rdy_pid, SIGTERM);
+		rdy_pid = 0;
+	}
+
+	set_state(UP);
+	depgraph::queue_step();
+}
+
+void unit::on_notify_eof(void) {
+	bool waiting = state == IN_RDY && rdy_pid == 0 && !probe_;
+
+	// the fallback only gets what is left of timeout/ready
+	if (waiting && timeout_timer) ready_left = timer::left(timeout_timer);
+	close_notify();
+	if (!waiting) return;
+
+	if (has_probe() || has_rdy_script()) {
+		log::note(term_name() + ": notify fd closed without ready notification, falling back to the ready probe or script");
+		step_have_probe();
+	}
+	else {
+		log::warn(term_name() + ": notify fd closed without ready notification");
+		step_active_run();
+	}
+	ready_left = 0;
+	depgraph::queue_step();
+}
@@ -0,0 +1,136 @@
+#include "wsunitd.hpp"
+
+#include <fstream>
+#include <sstream>
+
+#include <fcntl.h>
+
+
+
+// Every line of `WSUNIT_CONFIG_DIR/pressure` installs a PSI trigger, `<cpu|memory|io> <some|full> <stall> <window>`
+// with both times in microseconds (see the kernel's Documentation/accounting/psi.rst). While any trigger fired within
+// the last two windows, units are only started according to their `pressure-policy`: `pause` (the default) keeps them
+// in the start queue, `slow` starts them one at a time, `bypass` starts them as usual.
+
+class psi_handler : public epoll_handler {
+	public:
+		psi_handler(const string& resource, const string& trigger, uint64_t window) : resource(resource), window(window) {
+			fd = open(("/proc/pressure/" + resource).c_str(), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+			if (fd == -1)
+				throw runtime_error("could not open /proc/pressure/" + resource + ": " + strerror(errno));
+
+			if (write(fd, trigger.c_str(), trigger.size() + 1) == -1)
+				throw runtime_error("could not install trigger \"" + trigger + "\" for " + resource + " pressure: " + strerror(errno));
+		}
+
+		void handle(void) override { pressure::fired(resource, window); }
+
+	private:
+		string   resource;
+		uint64_t window;
+};
+
+string                   pressure::config;
+vector<int>              pressure::fds;
+map<string, timer_id>    pressure::active;
+map<string, uint64_t>    pressure::events_;
+map<string, uint64_t>    pressure::deferred_;
+set<string>              pressure::deferred_now;
+
+void pressure::configure(void) {
+	string c;
+	{
+		std::ifstream in(confdir / "pressure");
+		c.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+	}
+	if (c == config) return;
+	config = c;
+
+	for (int fd : fds) epoll_del(fd);
+	fds.clear();
+	for (auto& [r, t] : active) timer::cancel(t);
+	active.clear();
+	deferred_now.clear();
+
+	istringstream lines(c);
+	string line;
+	while (getline(lines, line)) {
+		istringstream ss(line);
+		string   resource, kind;
+		uint64_t stall, window;
+		if (!(ss >> resource)) continue;
+
+		if (!(ss >> kind >> stall >> window) || (kind != "some" && kind != "full")) {
+			log::warn("could not parse \"" + line + "\" in " + (confdir / "pressure").string() + ", expected \"<resource> <some|full> <stall> <window>\"");
+			continue;
+		}
+
+		try {
+			auto h = make_shared<psi_handler>(resource, kind + " " + to_string(stall) + " " + to_string(window), window * 1000);
+			epoll_add(h, EPOLLPRI);
+			fds.push_back(h->getfd());
+			log::note("watching " + resource + " pressure (" + kind + " " + to_string(stall) + "us per " + to_string(window) + "us)");
+		}
+		catch (exception& ex) {
+			log::warn(ex.what());
+		}
+	}
+
+	write_state();
+}
+
+void pressure::fired(const string& resource, uint64_t window) {
+	events_[resource]++;
+
+	auto it = active.find(resource);
+	if (it != active.end()) timer::cancel(it->second);
+	else                    log::warn(resource + " pressure, throttling unit starts");
+
+	// triggers fire at most once per window, so the pressure is considered gone after two quiet windows
+	active[resource] = timer::add(2 * window, [resource]{ eased(resource); });
+	write_state();
+}
+
+void pressure::eased(const string& resource) {
+	active.erase(resource);
+	log::note(resource + " pressure eased");
+
+	if (!throttled()) deferred_now.clear();
+	write_state();
+	depgraph::queue_step();
+}
+
+bool pressure::throttled(void) { return !active.empty(); }
+
+bool pressure::admit(shared_ptr<unit> u, size_t starting, reason_t* reason) {
+	// shutting down frees resources, holding it back would only prolong the pressure
+	if (!throttled() || in_shutdown) return true;
+
+	string policy = "pause";
+	path p = u->dir() / "pressure-policy";
+	if (is_regular_file(p)) std::ifstream(p) >> policy;
+
+	if (policy == "bypass") return true;
+	if (policy == "slow" && starting == 0) return true;
+	if (policy != "slow" && policy != "pause")
+		log::warn(u->term_name() + ": unknown pressure policy \"" + policy + "\", expected pause, slow or bypass");
+
+	// counted once per unit and period of pressure, not once per pass over the start queue
+	if (deferred_now.insert(u->name()).second) deferred_[u->name()]++;
+
+	if (reason) *reason = reason_t(R_PRESSURE);
+	return false;
+}
+
+const map<string, uint64_t>& pressure::events  (void) { return events_  ; }
+const map<string, uint64_t>& pressure::deferred(void) { return deferred_; }
+
+void pressure::write_state(void) {
+	std::ofstream out(statedir / "pressure");
+	if (!throttled()) out << "ok";
+	else {
+		out << "throttled";
+		for (auto& [r, t] : active) out << " " << r;
+	}
+	out << endl;
+}
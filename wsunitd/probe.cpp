@@ -0,0 +1,309 @@
+#include "wsunitd.hpp"
+
+#include <fstream>
+#include <sstream>
+
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+
+
+// Probes are checks wsunitd runs itself, without forking, for `ready-probe` and `health-probe`:
+//
+//     tcp <host> <port>   a connection to the port succeeds
+//     unix <path>         a connection to the unix socket succeeds
+//     line <path> <text>  the first line read from the unix socket contains <text>
+//     path <path>         the path exists, watched with inotify
+//
+// Connections are made non-blocking from the epoll loop. Host names are not resolved, as a lookup would block it,
+// except for `localhost`, which stands for ::1 and 127.0.0.1. A tcp probe tries the addresses in turn and only fails if
+// none of them accepts. A ready probe repeats failed attempts every `ready-probe-interval` seconds (default 0.1), a
+// health probe is a single attempt.
+
+class probe_handler : public epoll_handler {
+	public:
+		probe_handler(int fd, function<void(void)> fn) : fn(fn) { this->fd = fd; }
+		void handle(void) override { fn(); }
+
+	private:
+		function<void(void)> fn;
+};
+
+class probe : public enable_shared_from_this<probe> {
+	public:
+		typedef function<void(bool ok, const string& why)> callback;
+
+		probe(const string& spec, uint64_t interval, callback done) : interval(interval), done(done), retry_timer(0), addr(0), fd(-1), ifd(-1), connected(false) {
+			istringstream ss(spec);
+			ss >> type;
+
+			if (type == "tcp") {
+				ss >> host >> port;
+				if (port.empty()) throw runtime_error("expected tcp <host> <port>");
+				resolve();
+			}
+			else if (type == "unix" || type == "path") {
+				ss >> p;
+				if (p.empty()) throw runtime_error("expected " + type + " <path>");
+			}
+			else if (type == "line") {
+				ss >> p;
+				getline(ss >> ws, text);
+				if (p.empty() || text.empty()) throw runtime_error("expected line <path> <text>");
+			}
+			else
+				throw runtime_error("unknown probe type \"" + type + "\", expected tcp, unix, line or path");
+		}
+
+		~probe(void) {
+			if (retry_timer) timer::cancel(retry_timer);
+			if (fd  != -1) epoll_del(fd);
+			if (ifd != -1) epoll_del(ifd);
+		}
+
+		void attempt(void) {
+			retry_timer = 0;
+
+			if (type == "path") {
+				if (exists(p)) return done(true, "");
+				if (interval && ifd == -1) watch();
+				if (ifd == -1) retry(p + " does not exist");
+				return;
+			}
+
+			if (type == "tcp") {
+				addr = 0;
+				return connect_next("");
+			}
+
+			struct sockaddr_un sa = {};
+			sa.sun_family = AF_UNIX;
+			if (p.size() >= sizeof(sa.sun_path)) return done(false, "socket path too long");
+			strcpy(sa.sun_path, p.c_str());
+
+			int s = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+			if (s == -1) return done(false, string("could not create socket: ") + strerror(errno));
+			if (connect(s, (struct sockaddr*) &sa, sizeof(sa)) == -1 && errno != EINPROGRESS) {
+				string why = string("could not connect: ") + strerror(errno);
+				close(s);
+				return retry(why);
+			}
+			wait_connect(s);
+		}
+
+	private:
+		string   type, host, port, p, text;
+		uint64_t interval;
+		callback done;
+		timer_id retry_timer;
+		size_t   addr; // the next address of addrs to try
+		int      fd, ifd;
+		bool     connected;
+		string   line;
+
+		vector<pair<struct sockaddr_storage, socklen_t>> addrs;
+
+		void resolve(void) {
+			vector<string> hosts = { host };
+			if (host == "localhost") hosts = { "::1", "127.0.0.1" };
+
+			for (auto& h : hosts) {
+				struct addrinfo hints = {}, *res;
+				hints.ai_family   = AF_UNSPEC;
+				hints.ai_socktype = SOCK_STREAM;
+				hints.ai_flags    = AI_NUMERICHOST;
+				int e = getaddrinfo(h.c_str(), port.c_str(), &hints, &res);
+				if (e != 0) throw runtime_error("could not resolve " + h + " " + port + " as a numeric address: " + gai_strerror(e));
+
+				for (struct addrinfo* i = res; i; i = i->ai_next) {
+					struct sockaddr_storage sa = {};
+					memcpy(&sa, i->ai_addr, i->ai_addrlen);
+					addrs.emplace_back(sa, i->ai_addrlen);
+				}
+				freeaddrinfo(res);
+			}
+		}
+
+		void connect_next(string why) {
+			for (; addr < addrs.size(); ++addr) {
+				auto& [sa, len] = addrs[addr];
+				int s = socket(sa.ss_family, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+				if (s == -1) {
+					why = string("could not create socket: ") + strerror(errno);
+					continue;
+				}
+				if (connect(s, (struct sockaddr*) &sa, len) == -1 && errno != EINPROGRESS) {
+					why = string("could not connect: ") + strerror(errno);
+					close(s);
+					continue;
+				}
+
+				++addr;
+				return wait_connect(s);
+			}
+			retry(why);
+		}
+
+		void wait_connect(int s) {
+			weak_ptr<probe> w = shared_from_this();
+			epoll_add(make_shared<probe_handler>(s, [w]{
+				with_weak_ptr(w, false, [](shared_ptr<probe> pr) {
+					if (pr->connected) pr->readable();
+					else               pr->writable();
+					return true;
+				});
+			}), EPOLLOUT);
+			fd = s;
+		}
+
+		// without an interval, the probe is a single check and reports the failure instead of trying again
+		void retry(const string& why) {
+			if (fd != -1) {
+				epoll_del(fd);
+				fd = -1;
+			}
+			connected = false;
+			line.clear();
+
+			if (!interval) return done(false, why);
+
+			weak_ptr<probe> w = shared_from_this();
+			retry_timer = timer::add(interval, [w]{
+				with_weak_ptr(w, false, [](shared_ptr<probe> pr) { pr->attempt(); return true; });
+			});
+		}
+
+		void writable(void) {
+			int e = 0;
+			socklen_t l = sizeof(e);
+			if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &e, &l) == -1 || e != 0) {
+				string why = string("could not connect: ") + strerror(e ? e : errno);
+				if (addr >= addrs.size()) return retry(why);
+
+				epoll_del(fd);
+				fd = -1;
+				return connect_next(why);
+			}
+
+			if (type != "line") return done(true, "");
+
+			connected = true;
+			if (!epoll_mod(fd, EPOLLIN)) retry("could not wait for input");
+		}
+
+		void readable(void) {
+			char buf[256];
+			ssize_t n;
+			while ((n = read(fd, buf, sizeof(buf))) > 0)
+				for (ssize_t i = 0; i < n; ++i) {
+					if (buf[i] == '\n') {
+						if (line.find(text) != string::npos) return done(true, "");
+						return retry("unexpected line \"" + line + "\"");
+					}
+					if (line.size() < 4096) line += buf[i];
+				}
+
+			if (n == 0) retry("connection closed before a complete line");
+			else if (errno != EAGAIN && errno != EWOULDBLOCK) retry(string("could not read: ") + strerror(errno));
+		}
+
+		void watch(void) {
+			path d = path(p).parent_path();
+			if (d.empty()) d = ".";
+
+			int i = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+			if (i == -1) return;
+			if (inotify_add_watch(i, d.c_str(), IN_CREATE | IN_MOVED_TO | IN_CLOSE_WRITE) == -1) {
+				close(i);
+				return;
+			}
+
+			weak_ptr<probe> w = shared_from_this();
+			epoll_add(make_shared<probe_handler>(i, [w, i]{
+				char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+				while (read(i, buf, sizeof(buf)) > 0);
+				with_weak_ptr(w, false, [](shared_ptr<probe> pr) {
+					if (exists(pr->p)) pr->done(true, "");
+					return true;
+				});
+			}));
+			ifd = i;
+
+			// the path may have appeared between the first check and setting up the watch
+			if (exists(p)) done(true, "");
+		}
+};
+
+shared_ptr<probe> make_probe(const string& spec, uint64_t interval, probe::callback done) {
+	return make_shared<probe>(spec, interval, done);
+}
+
+void run_probe(shared_ptr<probe> pr) {
+	pr->attempt();
+}
+
+bool unit::has_probe(void) { return is_regular_file(dir() / "ready-probe"); }
+
+void unit::start_probe(void) {
+	string spec;
+	getline(std::ifstream((dir() / "ready-probe").string()), spec);
+
+	double secs = 0.1;
+	path ip = config_file("ready-probe-interval");
+	if (!ip.empty() && (!(std::ifstream(ip) >> secs) || secs <= 0)) {
+		log::warn(term_name() + ": could not parse " + ip.string() + ", expected a positive number of seconds");
+		secs = 0.1;
+	}
+
+	weak_ptr<unit> w = shared_from_this();
+	try {
+		probe_ = make_probe(spec, secs * 1e9, [w](bool ok, const string& why) {
+			with_weak_ptr(w, false, [ok, &why](shared_ptr<unit> u) { u->on_probe(ok, why); return true; });
+		});
+	}
+	catch (exception& ex) {
+		log::warn(term_name() + ": invalid ready probe \"" + spec + "\": " + ex.what());
+		step_have_rdy_script();
+		return;
+	}
+
+	log::note(term_name() + ": probe " + spec);
+	wait_ready("ready probe");
+
+	// keep the probe alive if it succeeds right away
+	auto pr = probe_;
+	run_probe(pr);
+}
+
+// the timeout/ready of the probe ends with it, or it would cut short the wait of the next start
+void unit::stop_probe(void) {
+	if (probe_ && timeout_timer) {
+		timer::cancel(timeout_timer);
+		timeout_timer = 0;
+	}
+	probe_.reset();
+}
+
+void unit::on_probe(bool ok, const string& why) {
+	stop_probe();
+	if (state != IN_RDY) return;
+
+	if (timeout_timer) {
+		timer::cancel(timeout_timer);
+		timeout_timer = 0;
+	}
+
+	if (ok) {
+		log::note(term_name() + ": ready probe succeeded");
+		set_state(UP);
+	}
+	else {
+		log::warn(term_name() + ": ready probe failed: " + why);
+		step_active_run();
+	}
+
+	depgraph::queue_step();
+}
@@ -0,0 +1,281 @@
+#include "wsunitd.hpp"
+
+#include <fstream>
+#include <sstream>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+
+
+
+// On SIGHUP, wsunitd executes itself again (argv[0], which may have been replaced by a newer binary) without stopping
+// any unit. The re-exec waits until every unit is either down or ready, so that only the run script of a unit is left
+// running and no timers other than health checks and schedules, which are armed again afterwards, are pending. The state
+// of each unit is passed in a memfd named by WSUNIT_REEXEC_FD, one tab-separated record per line:
+//
+//     wsunitd-reexec 1 <started_at>
+//     unit <name> <state> <run pid> <notify fd> <restart streak> <state since>
+//     restarts <name> <time>...
+//     states <name> <count> <time>...
+//     exit <name> <script> <runs> <failures> <timeouts> <last status>
+//     sched <name> <scheduled> <fired> <skipped>
+//     health <name> <checks> <failures> <failing> <latency> <stops>
+//     socket <name> <socket> <fd> <spec>
+//     trace <fd> <name> <trace pid>...
+//
+// The run scripts stay children of the same pid, the sockets, notify pipes and the trace file are inherited. Exits of
+// other scripts that were still running (health checks, events) are ignored by the new instance.
+
+static const string reexec_magic = "wsunitd-reexec";
+
+char**                        reexec::argv;
+bool                          reexec::requested;
+bool                          reexec::deferred;
+map<string, reexec::saved>    reexec::pending;
+
+void reexec::init(char** argv) { reexec::argv = argv; }
+
+void reexec::request(void) {
+	if (in_shutdown) {
+		log::warn("ignore re-exec request during shutdown");
+		return;
+	}
+	requested = true;
+	deferred  = false;
+}
+
+bool reexec::quiescent(string& why) {
+	for (auto& u : depgraph::get_units()) {
+		if ((u->state != unit::DOWN && u->state != unit::UP) || u->teardown_timer) {
+			why = u->name() + " is " + unit::state_descr(u->state);
+			return false;
+		}
+	}
+	return true;
+}
+
+void reexec::poll(void) {
+	if (!requested) return;
+
+	if (in_shutdown) {
+		log::warn("shutting down, cancel re-exec");
+		requested = false;
+		return;
+	}
+
+	string why;
+	if (!quiescent(why)) {
+		if (!deferred) log::note("re-exec deferred until all units are down or ready (" + why + ")");
+		deferred = true;
+		return;
+	}
+
+	requested = false;
+	exec();
+}
+
+static void set_cloexec(int fd, bool on) {
+	int flags = fcntl(fd, F_GETFD);
+	if (flags != -1) fcntl(fd, F_SETFD, on ? flags | FD_CLOEXEC : flags & ~FD_CLOEXEC);
+}
+
+void reexec::exec(void) {
+	ostringstream out;
+	out << reexec_magic << "\t1\t" << started_at << "\n";
+
+	vector<int> fds;
+	for (auto& u : depgraph::get_units()) {
+		// a failing streak outlives the check that is cut short here
+		unit::health_stats h = u->health_;
+		u->stop_health();
+
+		const string& n = u->name_;
+		out << "unit\t" << n << "\t" << u->state << "\t" << u->run_pid << "\t" << u->notify_fd << "\t" << u->restart_streak << "\t" << u->state_since << "\n";
+
+		out << "restarts\t" << n;
+		for (auto t : u->restart_times) out << "\t" << t;
+		out << "\n";
+
+		out << "states\t" << n;
+		for (int s = 0; s < unit::n_states; ++s) out << "\t" << u->state_counts[s] << "\t" << u->state_times[s];
+		out << "\n";
+
+		for (auto& [script, e] : u->exits_)
+			out << "exit\t" << n << "\t" << script << "\t" << e.runs << "\t" << e.failures << "\t" << e.timeouts << "\t" << e.last_status << "\n";
+
+		out << "sched\t"  << n << "\t" << u->scheduled << "\t" << u->sched_stats.fired << "\t" << u->sched_stats.skipped << "\n";
+		out << "health\t" << n << "\t" << h.checks << "\t" << h.failures << "\t" << h.failing << "\t" << h.latency << "\t" << h.stops << "\n";
+
+		for (auto& [sn, s] : u->sockets) {
+			if (s.fd == -1) continue;
+			out << "socket\t" << n << "\t" << sn << "\t" << s.fd << "\t" << s.spec << "\n";
+			fds.push_back(s.fd);
+		}
+
+		if (u->notify_fd != -1) fds.push_back(u->notify_fd);
+	}
+
+	if (trace::enabled()) {
+		out << "trace\t" << trace::fd;
+		for (auto& [n, p] : trace::pids) out << "\t" << n << "\t" << p;
+		out << "\n";
+		fds.push_back(trace::fd);
+	}
+
+	string buf = out.str();
+	int mfd = memfd_create("wsunitd-reexec", 0);
+	if (mfd == -1 || write(mfd, buf.data(), buf.size()) != (ssize_t) buf.size() || lseek(mfd, 0, SEEK_SET) == -1) {
+		log::err(string("could not save state for re-exec: ") + strerror(errno));
+		if (mfd != -1) close(mfd);
+		for (auto& u : depgraph::get_units()) if (u->state == unit::UP && u->has_health()) u->arm_health();
+		return;
+	}
+
+	for (int fd : fds) set_cloexec(fd, false);
+	setenv("WSUNIT_REEXEC_FD", to_string(mfd).c_str(), 1);
+
+	log::note("re-exec " + string(argv[0]) + " with " + to_string(depgraph::get_units().size()) + " units");
+	trace::flush();
+	log::flush();
+
+	execvp(argv[0], argv);
+
+	log::err("could not re-exec " + string(argv[0]) + ": " + strerror(errno));
+	unsetenv("WSUNIT_REEXEC_FD");
+	close(mfd);
+	for (int fd : fds) set_cloexec(fd, true);
+	for (auto& u : depgraph::get_units()) if (u->state == unit::UP && u->has_health()) u->arm_health();
+}
+
+static vector<string> fields(const string& line) {
+	vector<string> ret;
+	istringstream ss(line);
+	string f;
+	while (getline(ss, f, '\t')) ret.push_back(f);
+	return ret;
+}
+
+bool reexec::load(void) {
+	char* tmp = getenv("WSUNIT_REEXEC_FD");
+	if (!tmp) return false;
+
+	int fd = atoi(tmp);
+	unsetenv("WSUNIT_REEXEC_FD");
+
+	string buf;
+	char   chunk[4096];
+	ssize_t n;
+	while ((n = read(fd, chunk, sizeof(chunk))) > 0) buf.append(chunk, n);
+	close(fd);
+
+	istringstream lines(buf);
+	string line;
+	if (!getline(lines, line) || fields(line).size() != 3 || fields(line)[0] != reexec_magic || fields(line)[1] != "1") {
+		log::warn("could not read the state passed by the previous instance, starting from scratch");
+		return true;
+	}
+
+	try {
+		started_at = stoull(fields(line)[2]);
+
+		while (getline(lines, line)) {
+			auto f = fields(line);
+			if (f.size() < 2) throw runtime_error("short record \"" + line + "\"");
+
+			if (f[0] == "trace" && f.size() % 2 == 0) {
+				map<string, int> pids;
+				for (size_t i = 2; i < f.size(); i += 2) pids[f[i]] = stoi(f[i + 1]);
+				set_cloexec(stoi(f[1]), true);
+				trace::adopt(stoi(f[1]), pids);
+				continue;
+			}
+
+			saved& s = pending[f[1]];
+
+			if (f[0] == "unit" && f.size() == 7) {
+				s.state          = (unit::state_t) stoi(f[2]);
+				s.run_pid        = stoi(f[3]);
+				s.notify_fd      = stoi(f[4]);
+				s.restart_streak = stoul(f[5]);
+				s.state_since    = stoull(f[6]);
+				if (s.state != unit::DOWN && s.state != unit::UP) throw runtime_error("unexpected state for " + f[1]);
+			}
+			else if (f[0] == "restarts")
+				for (size_t i = 2; i < f.size(); ++i) s.restart_times.push_back(stoull(f[i]));
+			else if (f[0] == "states" && f.size() == 2 + 2 * unit::n_states)
+				for (int i = 0; i < unit::n_states; ++i) {
+					s.state_counts[i] = stoull(f[2 + 2 * i]);
+					s.state_times [i] = stoull(f[3 + 2 * i]);
+				}
+			else if (f[0] == "exit" && f.size() == 7)
+				s.exits[f[2]] = unit::exit_stats{ stoull(f[3]), stoull(f[4]), stoull(f[5]), stoi(f[6]) };
+			else if (f[0] == "sched" && f.size() == 5) {
+				s.scheduled   = stoi(f[2]);
+				s.sched_stats = unit::schedule_stats{ stoull(f[3]), stoull(f[4]) };
+			}
+			else if (f[0] == "health" && f.size() == 7)
+				s.health = unit::health_stats{ stoull(f[2]), stoull(f[3]), (unsigned) stoul(f[4]), stoull(f[5]), stoull(f[6]) };
+			else if (f[0] == "socket" && f.size() == 5)
+				s.sockets[f[2]] = unit::socket_t{ f[4], stoi(f[3]) };
+			else
+				throw runtime_error("unknown record \"" + line + "\"");
+		}
+	}
+	catch (exception& ex) {
+		log::warn(string("could not read the state passed by the previous instance: ") + ex.what());
+	}
+
+	log::note("re-executed, restoring " + to_string(pending.size()) + " units");
+	return true;
+}
+
+void reexec::restore(shared_ptr<unit> u) {
+	auto it = pending.find(u->name_);
+	if (it == pending.end()) return;
+	saved s = it->second;
+	pending.erase(it);
+
+	for (auto& [n, sock] : s.sockets) set_cloexec(sock.fd, true);
+	u->sockets = s.sockets;
+
+	u->state          = s.state;
+	u->restart_streak = s.restart_streak;
+	u->restart_times  = s.restart_times;
+	u->state_since    = s.state_since;
+	u->exits_         = s.exits;
+	u->scheduled      = s.scheduled;
+	u->sched_stats    = s.sched_stats;
+	u->health_        = s.health;
+	copy(begin(s.state_counts), end(s.state_counts), u->state_counts);
+	copy(begin(s.state_times ), end(s.state_times ), u->state_times );
+
+	if (s.notify_fd != -1) {
+		set_cloexec(s.notify_fd, true);
+		u->adopt_notify(s.notify_fd);
+	}
+
+	if (s.run_pid) {
+		u->run_pid = s.run_pid;
+		term_add(s.run_pid, unit::on_run_exit, u, "run");
+		cgroup::setup(u);
+	}
+
+	std::ofstream(statedir / "state" / u->name_) << unit::state_descr(u->state) << endl;
+	depgraph::state_changed(u);
+	if (u->state == unit::UP && u->has_health()) u->arm_health();
+
+	LOG_DEBUG(u->term_name() + ": restored as " + unit::state_descr(u->state) + (s.run_pid ? ", run pid " + to_string(s.run_pid) : ""));
+}
+
+// units removed from the configuration while the new instance was starting are not known anymore, stop what is left of
+// them
+void reexec::finish(void) {
+	for (auto& [n, s] : pending) {
+		log::warn(n + ": unit vanished during re-exec, stopping its run script");
+		if (s.run_pid) kill(-s.run_pid, SIGTERM);
+		if (s.notify_fd != -1) close(s.notify_fd);
+		for (auto& [sn, sock] : s.sockets) close(sock.fd);
+	}
+	pending.clear();
+}
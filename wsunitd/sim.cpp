@@ -0,0 +1,337 @@
+#include "wsunitd.hpp"
+
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <queue>
+#include <random>
+#include <sstream>
+
+#include <fcntl.h>
+
+
+
+// wsunitd-sim runs the scheduler of wsunitd on a virtual clock. Scripts are not executed: each script a unit would fork
+// becomes a modeled process that exits after a duration drawn from the `sim` file of the unit, so a boot of many units
+// replays in the time the scheduler itself needs, and the same graph, policy and seed always give the same schedule.
+//
+// Each line of `<unit>/sim` models one script:
+//
+//     <script> <duration ms> [<jitter ms> [<failure rate>]]
+//
+// The duration is drawn uniformly from duration ± jitter, and the script exits with code 1 instead of 0 with the given
+// probability. `kill <ms>` sets how long scripts take to exit after a signal. Scripts without a line exit successfully
+// right away, except the run script, which runs until it is killed.
+
+class sim_backend : public backend {
+	public:
+		sim_backend(uint64_t seed) : clock(1000000000), rng(seed), last_pid(1) {}
+
+		uint64_t now(void) override { return clock; }
+
+		pid_t fork(void) override { return ++last_pid; }
+
+		void spawned(pid_t pid, shared_ptr<unit> u, const string& script) override {
+			auto& m = models(u);
+			auto it = m.find(script);
+
+			proc& p = procs[pid];
+			p.kill_delay = m.count("kill") ? m.at("kill").duration : 0;
+
+			if (it == m.end()) {
+				if (script != "run") exit_at(pid, clock, 0);
+				return;
+			}
+
+			const model& s = it->second;
+			uint64_t lo = s.duration > s.jitter ? s.duration - s.jitter : 0;
+			uint64_t d  = uniform_int_distribution<uint64_t>(lo, s.duration + s.jitter)(rng);
+			bool failed = s.failure > 0 && uniform_real_distribution<double>(0, 1)(rng) < s.failure;
+			exit_at(pid, clock + d, failed ? 1 << 8 : 0);
+		}
+
+		int kill(pid_t pid, int signo) override {
+			auto it = procs.find(pid < 0 ? -pid : pid);
+			if (it == procs.end()) {
+				errno = ESRCH;
+				return -1;
+			}
+
+			proc& p = it->second;
+			if (signo != 0 && !(p.pending && p.exits <= clock + p.kill_delay)) exit_at(it->first, clock + p.kill_delay, signo);
+			return 0;
+		}
+
+		void reap(void) override {
+			struct rusage ru = {};
+			while (!exits.empty() && exits.top().at <= clock) {
+				event e = exits.top();
+				exits.pop();
+
+				auto it = procs.find(e.pid);
+				if (it == procs.end() || it->second.seq != e.seq) continue;
+				int status = it->second.status;
+				procs.erase(it);
+				term_handle(e.pid, status, ru);
+			}
+		}
+
+		// the earliest pending process exit, 0 if none
+		uint64_t next(void) {
+			while (!exits.empty()) {
+				auto it = procs.find(exits.top().pid);
+				if (it != procs.end() && it->second.seq == exits.top().seq) return exits.top().at;
+				exits.pop();
+			}
+			return 0;
+		}
+
+		void advance(uint64_t t) { if (t > clock) clock = t; }
+
+		size_t running(void) { return procs.size(); }
+
+	private:
+		struct model {
+			uint64_t duration; // ns
+			uint64_t jitter;   // ns
+			double   failure;
+		};
+
+		struct proc {
+			bool     pending    = false;
+			uint64_t exits      = 0;
+			int      status     = 0;
+			uint64_t seq        = 0;
+			uint64_t kill_delay = 0;
+		};
+
+		struct event {
+			uint64_t at;
+			uint64_t seq;
+			pid_t    pid;
+
+			bool operator<(const event& o) const { return at != o.at ? at > o.at : seq > o.seq; }
+		};
+
+		uint64_t                   clock;
+		mt19937_64                 rng;
+		pid_t                      last_pid;
+		uint64_t                   last_seq = 0;
+		map<pid_t, proc>           procs;
+		priority_queue<event>      exits;
+		map<string, map<string, model>> cache;
+
+		void exit_at(pid_t pid, uint64_t at, int status) {
+			proc& p = procs[pid];
+			p.pending = true;
+			p.exits   = at;
+			p.status  = status;
+			p.seq     = ++last_seq;
+			exits.push(event{ at, p.seq, pid });
+		}
+
+		// instances share the model of their template, like their scripts
+		map<string, model>& models(shared_ptr<unit> u) {
+			path p = u->dir() / "sim";
+			auto it = cache.find(p.string());
+			if (it != cache.end()) return it->second;
+
+			map<string, model>& m = cache[p.string()];
+			std::ifstream in(p);
+			string line;
+			while (getline(in, line)) {
+				if (line.empty() || line[0] == '#') continue;
+
+				stringstream ss(line);
+				string script;
+				double duration = -1, jitter = 0, failure = 0;
+				ss >> script >> duration;
+				if (ss >> jitter) ss >> failure;
+				if (script.empty() || duration < 0 || jitter < 0 || failure < 0 || failure > 1) {
+					log::warn("could not parse " + p.string() + ": " + line);
+					continue;
+				}
+				m[script] = model{ (uint64_t) (duration * 1e6), (uint64_t) (jitter * 1e6), failure };
+			}
+			return m;
+		}
+};
+
+static int usage(void) {
+	cerr << "Usage: wsunitd-sim run [<seed> [learn]]" << endl
+	     << "       wsunitd-sim generate <units> [<seed> [<failure rate>]]" << endl;
+	return 1;
+}
+
+// Writes a random dependency graph of `n` units into the config directory. Every unit depends on up to three earlier
+// units, and the units nothing depends on are dependencies of @default, so the graph is acyclic and all of it is needed.
+static int generate(unsigned n, uint64_t seed, double failure) {
+	mt19937_64 rng(seed);
+	auto chance = [&rng](double p) { return uniform_real_distribution<double>(0, 1)(rng) < p; };
+
+	int width = to_string(n).size();
+	auto name = [width](unsigned i) {
+		stringstream ss;
+		ss << "u" << setw(width) << setfill('0') << i;
+		return ss.str();
+	};
+
+	vector<bool> leaf(n, true);
+	for (unsigned i = 0; i < n; ++i) {
+		path d = confdir / name(i);
+		create_directories(d / "deps");
+
+		unsigned deps = i == 0 ? 0 : uniform_int_distribution<unsigned>(0, min(i, 3u))(rng);
+		for (unsigned k = 0; k < deps; ++k) {
+			unsigned j = uniform_int_distribution<unsigned>(0, i - 1)(rng);
+			std::ofstream(d / "deps" / name(j));
+			leaf[j] = false;
+		}
+
+		std::ofstream model(d / "sim");
+		for (const char* script : { "start", "run", "ready" }) {
+			if (!chance(string(script) == "ready" ? 0.2 : 0.6)) continue;
+
+			path s = d / script;
+			std::ofstream(s) << "#!/bin/sh" << endl;
+			permissions(s, perms::owner_all | perms::group_read | perms::group_exe | perms::others_read | perms::others_exe);
+
+			if (string(script) == "run") continue;
+			unsigned ms = uniform_int_distribution<unsigned>(10, string(script) == "start" ? 500 : 100)(rng);
+			model << script << " " << ms << " " << ms / 4 << " " << failure << endl;
+		}
+	}
+
+	create_directories(confdir / "@default" / "deps");
+	for (unsigned i = 0; i < n; ++i)
+		if (leaf[i]) std::ofstream(confdir / "@default" / "deps" / name(i));
+
+	return 0;
+}
+
+int main(int argc, char** argv) {
+	char* tmp;
+
+	tmp = getenv("WSUNIT_CONFIG_DIR");
+	if (!tmp) {
+		log::fatal("WSUNIT_CONFIG_DIR environment variable is not set");
+		return 1;
+	}
+	confdir = tmp;
+
+	tmp = getenv("WSUNIT_STATE_DIR");
+	if (!tmp) {
+		log::fatal("WSUNIT_STATE_DIR environment variable is not set");
+		return 1;
+	}
+	statedir = tmp;
+
+	tmp = getenv("WSUNIT_LOG_DIR");
+	if (!tmp) {
+		log::fatal("WSUNIT_LOG_DIR environment variable is not set");
+		return 1;
+	}
+	logdir = tmp;
+
+	if (argc < 2) return usage();
+	string cmd = argv[1];
+	uint64_t seed;
+	bool     learn;
+
+	try {
+		if (cmd == "generate" && argc >= 3 && argc <= 5) {
+			mkdirs();
+			return generate(stoul(argv[2]), argc >= 4 ? stoull(argv[3]) : 1, argc >= 5 ? stod(argv[4]) : 0);
+		}
+		if (cmd != "run" || argc > 4) return usage();
+		seed = argc >= 3 ? stoull(argv[2]) : 1;
+		if (argc == 4 && string(argv[3]) != "learn") return usage();
+		learn = argc == 4;
+	}
+	catch (exception& ex) {
+		return usage();
+	}
+
+	tmp = getenv("WSUNIT_VERBOSE");
+	log::verbose = tmp && *tmp;
+
+	tmp = getenv("WSUNIT_TRACE");
+	if (tmp && *tmp) trace::open(tmp);
+
+	sim_backend sim(seed);
+	backend::current = &sim;
+	started_at = monotime();
+
+	// the schedule goes to stdout, the log to WSUNIT_LOG_DIR/_ as with wsunitd
+	int out = dup(1);
+	mkdirs();
+	remove(logdir / "_");
+	output_logfile("_");
+
+	// the start durations learned from this boot are only kept if asked for, so that runs can be repeated
+	path durations = logdir / "_durations";
+	bool had_durations = is_regular_file(durations);
+	string saved_durations;
+	if (had_durations) {
+		std::ifstream in(durations);
+		saved_durations.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+	}
+
+	depgraph::refresh();
+	depgraph::start_stop_units();
+
+	const uint64_t limit = 24 * 3600 * 1000000000ull;
+	shared_ptr<unit> target;
+	for (auto& u : depgraph::get_units())
+		if (u->name() == "@default") target = u;
+
+	while (!(target && target->get_state() == unit::UP && depgraph::is_settled())) {
+		uint64_t t = sim.next();
+		uint64_t s = timer::next();
+		if (!t || (s && s < t)) t = s;
+		if (!t || t - started_at > limit) break;
+
+		sim.advance(t);
+		waitall();
+		if (timer::next() && timer::next() <= monotime()) timer::expire();
+	}
+
+	bool done = target && target->get_state() == unit::UP && depgraph::is_settled();
+	uint64_t end = done ? target->timing().ready : monotime();
+	metrics::write();
+	log::flush();
+
+	if (!learn) {
+		if (had_durations) std::ofstream(durations) << saved_durations;
+		else               remove(durations);
+	}
+
+	vector<shared_ptr<unit>> units = depgraph::get_units();
+	stable_sort(units.begin(), units.end(), [](const shared_ptr<unit>& a, const shared_ptr<unit>& b) {
+		return a->timing().started < b->timing().started;
+	});
+
+	// times are in ms since the simulated boot
+	auto ms = [](uint64_t t) { return t ? to_string((t - started_at) / 1000000) : string("-"); };
+	stringstream ss;
+	for (auto& u : units)
+		if (u->timing().started)
+			ss << ms(u->timing().started) << "\t" << ms(u->timing().ready) << "\t" << u->name() << "\t" << u->timing().blocker << "\n";
+	ss << "makespan\t" << (end - started_at) / 1000000 << "\n";
+	if (!done) ss << "unsettled\t" << (target ? unit::state_descr(target->get_state()) : string("@default missing")) << "\t" << sim.running() << " running\n";
+
+	string s = ss.str();
+	const char* p = s.data();
+	size_t      l = s.size();
+	while (l > 0) {
+		ssize_t n = write(out, p, l);
+		if (n == -1) {
+			if (errno == EINTR) continue;
+			break;
+		}
+		p += n;
+		l -= n;
+	}
+
+	return done ? 0 : 2;
+}
@@ -0,0 +1,167 @@
+#include "wsunitd.hpp"
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+
+
+// Every file in the `sockets` directory of a unit declares one listening socket, named after the file, as
+// `unix <path>`, `tcp <host> <port>` or `udp <host> <port>` (host `*` for any IPv4 or IPv6 address). The sockets are
+// bound when the dependency graph is refreshed and stay open until the declaration changes, so connections made while
+// the unit is down are queued until it accepts them.
+
+static int bind_socket(const string& spec, string& err) {
+	istringstream ss(spec);
+	string type;
+	ss >> type;
+
+	if (type == "unix") {
+		string p;
+		ss >> p;
+
+		struct sockaddr_un sa = {};
+		sa.sun_family = AF_UNIX;
+		if (p.empty() || p.size() >= sizeof(sa.sun_path)) {
+			err = "invalid socket path \"" + p + "\"";
+			return -1;
+		}
+		strcpy(sa.sun_path, p.c_str());
+
+		int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (fd == -1) {
+			err = string("could not create socket: ") + strerror(errno);
+			return -1;
+		}
+
+		// a socket left behind by a previous instance would make bind fail
+		struct stat st;
+		if (lstat(p.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) unlink(p.c_str());
+
+		if (::bind(fd, (struct sockaddr*) &sa, sizeof(sa)) == -1 || listen(fd, SOMAXCONN) == -1) {
+			err = "could not listen on " + p + ": " + strerror(errno);
+			close(fd);
+			return -1;
+		}
+		return fd;
+	}
+
+	if (type == "tcp" || type == "udp") {
+		string host, port;
+		ss >> host >> port;
+
+		struct addrinfo hints = {}, *res;
+		hints.ai_family   = AF_UNSPEC;
+		hints.ai_socktype = type == "tcp" ? SOCK_STREAM : SOCK_DGRAM;
+		hints.ai_flags    = AI_PASSIVE;
+
+		int r = getaddrinfo(host == "*" ? 0 : host.c_str(), port.c_str(), &hints, &res);
+		if (r != 0) {
+			err = "could not resolve " + host + " " + port + ": " + gai_strerror(r);
+			return -1;
+		}
+
+		// `*` binds a single IPv6 socket that also accepts IPv4 connections, falling back to IPv4 without IPv6 support;
+		// other hosts are tried in the order of their addresses until one can be bound
+		vector<struct addrinfo*> addrs;
+		for (struct addrinfo* a = res; a; a = a->ai_next) addrs.push_back(a);
+		if (host == "*")
+			stable_partition(addrs.begin(), addrs.end(), [](struct addrinfo* a) { return a->ai_family == AF_INET6; });
+
+		int fd = -1;
+		for (struct addrinfo* a : addrs) {
+			fd = socket(a->ai_family, a->ai_socktype | SOCK_CLOEXEC, a->ai_protocol);
+			if (fd == -1) {
+				err = string("could not create socket: ") + strerror(errno);
+				continue;
+			}
+
+			int one = 1, zero = 0;
+			setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+			if (host == "*" && a->ai_family == AF_INET6) setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero));
+
+			if (::bind(fd, a->ai_addr, a->ai_addrlen) == 0 && (type != "tcp" || listen(fd, SOMAXCONN) == 0)) break;
+
+			err = "could not listen on " + type + " " + host + " " + port + ": " + strerror(errno);
+			close(fd);
+			fd = -1;
+		}
+
+		freeaddrinfo(res);
+		return fd;
+	}
+
+	err = "unknown socket type \"" + type + "\", expected unix, tcp or udp";
+	return -1;
+}
+
+void unit::bind_sockets(void) {
+	map<string, string> specs;
+	path d = dir() / "sockets";
+	if (is_directory(d))
+		for (directory_entry& e : directory_iterator(d)) {
+			string spec;
+			getline(std::ifstream(e.path()), spec);
+			specs.emplace(e.path().filename().string(), spec);
+		}
+
+	for (auto it = sockets.begin(); it != sockets.end(); )
+		if (specs.count(it->first) == 0 || specs.at(it->first) != it->second.spec) {
+			LOG_DEBUG(term_name() + ": close socket " + it->first);
+			if (it->second.fd != -1) close(it->second.fd);
+			it = sockets.erase(it);
+		}
+		else ++it;
+
+	for (auto& [n, spec] : specs) {
+		if (sockets.count(n) && sockets.at(n).fd != -1) continue;
+
+		string err;
+		int fd = bind_socket(spec, err);
+		if (fd == -1) log::warn(term_name() + ": socket " + n + ": " + err);
+		else          LOG_DEBUG(term_name() + ": bound socket " + n + " (" + spec + ")");
+
+		sockets[n] = socket_t{ spec, fd };
+	}
+}
+
+bool unit::sockets_bound(void) {
+	if (sockets.empty()) return false;
+	for (auto& [n, s] : sockets) if (s.fd == -1) return false;
+	return true;
+}
+
+// Called in the forked run script: the sockets are passed as fds 3, 4, ... in the order of their names, following
+// the LISTEN_FDS convention of sd_listen_fds(3). WSUNIT_SOCKETS additionally lists them as `<name>=<fd>`.
+void unit::pass_sockets(void) {
+	vector<pair<string, int>> fds;
+	for (auto& [n, s] : sockets)
+		if (s.fd != -1) fds.emplace_back(n, s.fd);
+	if (fds.empty()) return;
+
+	// move everything above the target range first, so no socket is overwritten before it was moved
+	for (auto& [n, fd] : fds)
+		if ((fd = fcntl(fd, F_DUPFD_CLOEXEC, 3 + (int) fds.size())) == -1) {
+			log::err(term_name() + ": could not pass socket " + n + ": " + strerror(errno));
+			exit(1);
+		}
+
+	string names, list;
+	for (size_t i = 0; i < fds.size(); ++i) {
+		dup2(fds[i].second, 3 + i);
+		names += (i ? ":" : "") + fds[i].first;
+		list  += (i ? " " : "") + fds[i].first + "=" + to_string(3 + i);
+	}
+
+	setenv("LISTEN_FDS"    , to_string(fds.size()).c_str(), 1);
+	setenv("LISTEN_PID"    , to_string(getpid()).c_str()  , 1);
+	setenv("LISTEN_FDNAMES", names.c_str()                , 1);
+	setenv("WSUNIT_SOCKETS", list.c_str()                 , 1);
+}
@@ -0,0 +1,89 @@
+#include "wsunitd.hpp"
+
+#include <limits.h>
+
+
+
+// A unit directory whose name ends in `@`, like `worker@`, is a template. Its instances `worker@<instance>` have no
+// directory of their own: they use the scripts and configuration of the template, with WSUNIT_INSTANCE set to
+// `<instance>` for every script they run. An instance exists while it is named in `WSUNIT_STATE_DIR/wanted` or in the
+// dependency declarations of another unit. Names in the dependency directories of the template may contain `%i`, which
+// is replaced by the instance name, so `worker@/deps/cache@%i` makes each worker depend on its own cache instance.
+
+string unit::template_of(const string& name) {
+	size_t at = name.find('@');
+	if (at == 0 || at == string::npos || at + 1 == name.size()) return "";
+	return name.substr(0, at + 1);
+}
+
+bool unit::is_template(const string& name) { return name.size() > 1 && name.back() == '@' && name.find('@') == name.size() - 1; }
+
+string unit::instance(void) {
+	return template_.empty() ? "" : name_.substr(template_.size());
+}
+
+// Called in forked scripts.
+void unit::instance_env(void) {
+	if (!template_.empty()) setenv("WSUNIT_INSTANCE", instance().c_str(), 1);
+}
+
+map<string, depgraph::decl> depgraph::instances;
+
+static string substitute(const string& s, const string& instance) {
+	string ret;
+	for (size_t i = 0; i < s.size(); ++i)
+		if (s[i] == '%' && i + 1 < s.size() && s[i + 1] == 'i') {
+			ret += instance;
+			++i;
+		}
+		else ret += s[i];
+	return ret;
+}
+
+void depgraph::instantiate(void) {
+	deque<string> todo;
+
+	auto want = [&todo](const string& n) {
+		string t = unit::template_of(n);
+		if (t.empty() || instances.count(n) || decls.count(n)) return;
+
+		auto it = decls.find(t);
+		if (it == decls.end() || !it->second.dir) return;
+
+		if (n.size() > NAME_MAX) {
+			log::warn("ignore instance " + n + ": name too long");
+			return;
+		}
+
+		string inst = n.substr(t.size());
+		decl d = it->second;
+		for (auto& names : d.names) {
+			set<string> s;
+			for (auto& m : names) s.insert(substitute(m, inst));
+			names.swap(s);
+		}
+
+		instances.emplace(n, d);
+		todo.push_back(n);
+	};
+
+	instances.clear();
+
+	if (is_directory(statedir / "wanted"))
+		for (directory_entry& e : directory_iterator(statedir / "wanted")) want(e.path().filename().string());
+
+	for (auto& [n, d] : decls)
+		if (!unit::is_template(n))
+			for (auto& names : d.names)
+				for (auto& m : names) want(m);
+
+	// an instance may refer to further instances
+	while (!todo.empty()) {
+		string n = todo.front();
+		todo.pop_front();
+		for (auto& names : instances.at(n).names)
+			for (auto& m : names) want(m);
+	}
+
+	if (!instances.empty()) LOG_DEBUG(to_string(instances.size()) + " template instances");
+}
@@ -0,0 +1,123 @@
+#include "wsunitd.hpp"
+
+#include <sys/timerfd.h>
+
+
+
+// Timers live in a hashed wheel of `slots` lists, each covering one `tick`. A timer is filed under the slot of its
+// expiry tick, so adding and cancelling are O(1); timers further away than one revolution simply stay in their slot for
+// a few more rounds. The timerfd is armed for the earliest expiry of any timer.
+
+class timer_handler : public epoll_handler {
+	public:
+		timer_handler(void) {
+			fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+			if (fd == -1)
+				throw runtime_error(string("could not create timerfd: ") + strerror(errno));
+		}
+
+		void handle(void) override {
+			uint64_t n;
+			while (read(fd, &n, sizeof(n)) > 0);
+			timer::expire();
+		}
+};
+
+int                                                   timer::fd = -1;
+timer_id                                              timer::last_id;
+uint64_t                                              timer::current;
+uint64_t                                              timer::armed;
+list<timer::entry>                                    timer::wheel[timer::slots];
+unordered_map<timer_id, list<timer::entry>::iterator> timer::index;
+
+timer_id timer::add(uint64_t delay, function<void(void)> fn) {
+	if (fd == -1) {
+		try {
+			auto h = make_shared<timer_handler>();
+			epoll_add(h);
+			fd = h->getfd();
+			current = monotime() / tick;
+		}
+		catch (exception& ex) {
+			log::fatal(string("cannot continue without timers: ") + ex.what());
+			exit(1);
+		}
+	}
+
+	timer_id id      = ++last_id;
+	uint64_t expires = (monotime() + delay + tick - 1) / tick;
+	if (expires <= current) expires = current + 1;
+
+	auto& slot = wheel[expires % slots];
+	index.emplace(id, slot.insert(slot.end(), entry{ id, expires, fn }));
+
+	if (!armed || expires < armed) arm(expires);
+	return id;
+}
+
+void timer::cancel(timer_id id) {
+	auto it = index.find(id);
+	if (it == index.end()) return;
+
+	wheel[it->second->expires % slots].erase(it->second);
+	index.erase(it);
+}
+
+uint64_t timer::left(timer_id id) {
+	auto it = index.find(id);
+	if (it == index.end()) return 0;
+
+	uint64_t t = it->second->expires * tick, now = monotime();
+	return t > now ? t - now : 1;
+}
+
+void timer::expire(void) {
+	uint64_t now = monotime() / tick;
+
+	// collect first, callbacks may add or cancel timers
+	vector<timer_id> due;
+	for (uint64_t t = current + 1; t <= now && t <= current + slots; ++t)
+		for (auto& e : wheel[t % slots])
+			if (e.expires <= now) due.push_back(e.id);
+	current = now;
+
+	for (timer_id id : due) {
+		auto it = index.find(id);
+		if (it == index.end()) continue;
+
+		auto fn = move(it->second->fn);
+		wheel[it->second->expires % slots].erase(it->second);
+		index.erase(it);
+		fn();
+	}
+
+	// a slot may only hold timers for later rounds, which must not wake the loop every revolution
+	uint64_t next = 0;
+	for (uint64_t t = current + 1; t <= current + slots && !next && !index.empty(); ++t)
+		for (auto& e : wheel[t % slots])
+			if (e.expires == t) {
+				next = t;
+				break;
+			}
+	if (!next)
+		for (auto& [id, it] : index)
+			if (!next || it->expires < next) next = it->expires;
+	arm(next);
+}
+
+void timer::arm(uint64_t expires) {
+	struct itimerspec its = {};
+
+	armed = expires;
+	if (expires) {
+		its.it_value.tv_sec  = expires * tick / 1000000000;
+		its.it_value.tv_nsec = expires * tick % 1000000000;
+	}
+
+	if (timerfd_settime(fd, TFD_TIMER_ABSTIME, &its, 0) == -1)
+		log::err(string("could not arm timerfd: ") + strerror(errno));
+}
+
+uint64_t timer::next(void) {
+	return armed * tick;
+}
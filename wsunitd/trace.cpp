@@ -0,0 +1,142 @@
+#include "wsunitd.hpp"
+
+#include <cstdio>
+
+#include <fcntl.h>
+#include <sys/wait.h>
+
+
+
+int              trace::fd = -1;
+pid_t            trace::owner;
+string           trace::buf;
+bool             trace::first = true;
+map<string, int> trace::pids;
+
+void trace::open(const path& p) {
+	// after a re-exec, the trace file of the previous instance is passed on by reexec::load() instead
+	if (getenv("WSUNIT_REEXEC_FD")) return;
+
+	fd = ::open(p.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if (fd == -1) {
+		log::warn("could not open trace file " + p.string() + ": " + strerror(errno) + ", tracing disabled");
+		return;
+	}
+
+	owner = getpid();
+	buf   = "[\n";
+	emit("{\"ph\":\"M\",\"pid\":1,\"name\":\"process_name\",\"args\":{\"name\":\"wsunitd\"}}");
+	atexit(close);
+}
+
+void trace::adopt(int fd, const map<string, int>& pids) {
+	trace::fd    = fd;
+	trace::pids  = pids;
+	trace::first = false;
+	owner = getpid();
+	atexit(close);
+}
+
+void trace::flush(void) {
+	if (fd == -1 || getpid() != owner) return;
+
+	const char* p = buf.data();
+	size_t      l = buf.size();
+	while (l > 0) {
+		ssize_t n = write(fd, p, l);
+		if (n == -1) {
+			if (errno == EINTR) continue;
+			log::warn(string("could not write trace file: ") + strerror(errno));
+			break;
+		}
+		p += n;
+		l -= n;
+	}
+	buf.clear();
+}
+
+void trace::close(void) {
+	if (fd == -1 || getpid() != owner) return;
+
+	buf += "\n]\n";
+	flush();
+	::close(fd);
+	fd = -1;
+}
+
+void trace::span(const string& u, const string& script, pid_t pid, uint64_t begin, uint64_t end, int status) {
+	int p = pid_of(u);
+	string result = WIFSIGNALED(status) ? signal_string(WTERMSIG(status)) : "exit " + to_string(WEXITSTATUS(status));
+
+	emit("{\"ph\":\"M\",\"pid\":" + to_string(p) + ",\"tid\":" + to_string(pid) + ",\"name\":\"thread_name\",\"args\":{\"name\":" + str(script + " (" + to_string(pid) + ")") + "}}");
+	emit("{\"ph\":\"X\",\"cat\":\"script\",\"name\":" + str(script) + ",\"pid\":" + to_string(p) + ",\"tid\":" + to_string(pid)
+		+ ",\"ts\":" + ts(begin) + ",\"dur\":" + us(end - begin) + ",\"args\":{\"result\":" + str(result) + "}}");
+}
+
+void trace::state(const string& u, unit::state_t from, unit::state_t to) {
+	emit("{\"ph\":\"i\",\"s\":\"p\",\"cat\":\"state\",\"name\":" + str(unit::state_name(to)) + ",\"pid\":" + to_string(pid_of(u)) + ",\"tid\":0"
+		+ ",\"ts\":" + ts(monotime()) + ",\"args\":{\"from\":" + str(unit::state_name(from)) + ",\"to\":" + str(unit::state_name(to)) + "}}");
+}
+
+void trace::queue(const string& queue, const string& u, bool keep, const string& reason) {
+	emit("{\"ph\":\"i\",\"s\":\"t\",\"cat\":\"queue\",\"name\":" + str((keep ? "keep " : "drop ") + u) + ",\"pid\":1,\"tid\":0"
+		+ ",\"ts\":" + ts(monotime()) + ",\"args\":{\"queue\":" + str(queue) + ",\"unit\":" + str(u) + ",\"reason\":" + str(reason) + "}}");
+}
+
+void trace::counter(const string& name, size_t value) {
+	emit("{\"ph\":\"C\",\"name\":" + str(name) + ",\"pid\":1,\"ts\":" + ts(monotime()) + ",\"args\":{\"length\":" + to_string(value) + "}}");
+}
+
+int trace::pid_of(const string& u) {
+	auto it = pids.find(u);
+	if (it != pids.end()) return it->second;
+
+	int p = pids.size() + 2;
+	pids.emplace(u, p);
+	emit("{\"ph\":\"M\",\"pid\":" + to_string(p) + ",\"name\":\"process_name\",\"args\":{\"name\":" + str(u) + "}}");
+	emit("{\"ph\":\"M\",\"pid\":" + to_string(p) + ",\"tid\":0,\"name\":\"thread_name\",\"args\":{\"name\":\"state\"}}");
+	return p;
+}
+
+string trace::ts(uint64_t t) { return us(t - started_at); }
+
+string trace::us(uint64_t ns) {
+	char b[32];
+	snprintf(b, sizeof(b), "%.3f", ns / 1e3);
+	return b;
+}
+
+string trace::str(const string& s) {
+	string ret = "\"";
+	for (size_t i = 0; i < s.size(); ++i) {
+		char c = s[i];
+
+		// drop terminal color sequences as used by unit::term_name()
+		if (c == '\x1b' && i + 1 < s.size() && s[i + 1] == '[') {
+			i += 2;
+			while (i < s.size() && !(s[i] >= '@' && s[i] <= '~')) ++i;
+			continue;
+		}
+
+		switch (c) {
+			case '"' : ret += "\\\""; break;
+			case '\\': ret += "\\\\"; break;
+			case '\n': ret += "\\n" ; break;
+			case '\t': ret += "\\t" ; break;
+			default:
+				if ((unsigned char) c < 0x20) {
+					char b[8];
+					snprintf(b, sizeof(b), "\\u%04x", c);
+					ret += b;
+				}
+				else ret += c;
+		}
+	}
+	return ret + "\"";
+}
+
+void trace::emit(const string& ev) {
+	if (!first) buf += ",\n";
+	buf += ev;
+	first = false;
+}
@@ -1,18 +1,33 @@
 #include "wsunitd.hpp"
 
+#include <cmath>
 #include <fstream>
+#include <random>
 
 #include <signal.h>
+#include <sys/wait.h>
 
 
 
-unit::unit(string name) : name_(name), state(DOWN), logrot_pid(0), start_pid(0), rdy_pid(0), run_pid(0), stop_pid(0), restart_pid(0) {
+string reason_t::str(void) const { return reason_text(code, other ? other->term_name() : ""); }
+
+
+
+unit::unit(string name, string tmpl) : name_(name), template_(tmpl), state(DOWN), target_(false), logrot_pid(0), start_pid(0), rdy_pid(0), run_pid(0), stop_pid(0), restart_pid(0),
+	restart_timer(0), restart_streak(0), timeout_timer(0), timed_out(false), ready_left(0), teardown_timer(0),
+	sched_timer(0), sched_next(0), scheduled(false), sched_stats(), notify_fd(-1), notify_w(-1),
+	health_timer(0), health_timeout(0), health_pid(0), health_started(0), health_timedout(false), health_(), state_since(monotime()), state_counts(), state_times(), usage_dirty(false), queued_since(0), timing_() {
 	std::ofstream(statedir / "state" / name_) << "down" << endl;
 }
 
+unit::~unit(void) {
+	close_notify();
+	for (auto& [n, s] : sockets) if (s.fd != -1) close(s.fd);
+}
+
 string unit::name     (void) { return              name_            ; }
 string unit::term_name(void) { return "\x1b[34m" + name_ + "\x1b[0m"; }
-path   unit::dir      (void) { return    confdir / name_            ; }
+path   unit::dir      (void) { return confdir / (template_.empty() ? name_ : template_); }
 
 bool   unit::running (void) { return state != DOWN; }
 bool   unit::ready   (void) { return state == UP  ; }
@@ -23,6 +38,7 @@ bool unit::wanted(void) {
 	}
 	else {
 		if (name_ == "@default") return true;
+		if (scheduled) return true;
 		if (exists(statedir / "wanted" / name_)) return true;
 	}
 
@@ -39,31 +55,43 @@ bool unit::masked(void) {
 	return exists(statedir / "masked" / name_);
 }
 
-bool unit::blocked(void) {
-	if (masked()) return true;
-	for (auto& p : depgraph::get_deps(name_)) if (p->blocked()) return true;
-	return false;
+// A dependency reached through several paths is checked once per memo, which callers share across units while the
+// masked files cannot change.
+bool unit::blocked(map<string, bool>* memo) {
+	map<string, bool> local;
+	if (!memo) memo = &local;
+
+	auto it = memo->find(name_);
+	if (it != memo->end()) return it->second;
+
+	bool ret = masked();
+	for (auto& p : depgraph::get_deps(name_)) if (!ret && p->blocked(memo)) ret = true;
+	return (*memo)[name_] = ret;
 }
 
-bool unit::can_start(string* reason) {
+bool unit::can_start(reason_t* reason) {
 	if (need_settle() && !depgraph::is_settled(reason)) return false;
 	for (auto& p : depgraph::get_deps(name_))
 		if (!p->ready()) {
-			if (reason) *reason = "waiting for " + p->term_name() + " to be ready";
+			if (p->sockets_bound() && depgraph::socket_dep(name_, p->name())) continue;
+			if (reason) *reason = reason_t(R_WAIT_READY, p);
 			return false;
 		}
 	return true;
 }
 
-bool unit::can_stop(string* reason) {
+bool unit::can_stop(reason_t* reason) {
 	for (auto& p : depgraph::get_revdeps(name_))
 		if (p->running()) {
-			if (reason) *reason = "waiting for " + p->term_name() + " to stop running";
+			if (reason) *reason = reason_t(R_WAIT_STOPPED, p);
 			return false;
 		}
 	return true;
 }
 
+bool unit::target    (void)        { return target_; }
+void unit::set_target(bool target) { target_ = target; }
+
 bool unit::need_settle(void) {
 	return name_ == "@shutdown" || exists(dir() / "start-wait-settled");
 }
@@ -82,8 +110,31 @@ bool unit::has_rdy_script    (void) { auto p = dir() / "ready"  ; return is_regu
 bool unit::has_stop_script   (void) { auto p = dir() / "stop"   ; return is_regular_file(p) && access(p.c_str(), X_OK) == 0; }
 bool unit::has_restart_script(void) { auto p = dir() / "restart"; return is_regular_file(p) && access(p.c_str(), X_OK) == 0; }
 
+path unit::config_file(const string& name) {
+	auto p = dir() / name;
+	if (is_regular_file(p)) return p;
+	p = confdir / name;
+	if (is_regular_file(p)) return p;
+	return path();
+}
+
 enum unit::state_t unit::get_state(void) { return state; }
 
+string unit::state_name(state_t state) {
+	switch (state) {
+		case DOWN:       return "DOWN"      ;
+		case IN_LOGROT:  return "IN_LOGROT" ;
+		case IN_START:   return "IN_START"  ;
+		case IN_RDY:     return "IN_RDY"    ;
+		case UP:         return "UP"        ;
+		case IN_RDY_ERR: return "IN_RDY_ERR";
+		case IN_RUN:     return "IN_RUN"    ;
+		case IN_STOP:    return "IN_STOP"   ;
+		case IN_RESTART: return "IN_RESTART";
+	}
+	assert(false);
+}
+
 #pragma GCC diagnostic push
 	#pragma GCC diagnostic ignored "-Wmisleading-indentation"
 
@@ -101,73 +152,144 @@ enum unit::state_t unit::get_state(void) { return state; }
 
 #pragma GCC diagnostic pop
 
+uint64_t unit::state_count(state_t state) { return state_counts[state]; }
+
+uint64_t unit::state_duration(state_t state) {
+	uint64_t ret = state_times[state];
+	if (state == this->state) ret += monotime() - state_since;
+	return ret;
+}
 
+const map<string, unit::exit_stats>& unit::exits(void) { return exits_; }
+
+void unit::record_exit(const string& script, int status) {
+	auto& e = exits_[script];
+	e.runs++;
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) e.failures++;
+	e.last_status = WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status);
+}
 
-bool unit::request_start(string* reason) {
+
+const map<string, unit::usage_stats>& unit::usage(void) { return usage_; }
+
+// accounted per script kind, so all event scripts share one entry
+void unit::record_usage(const string& script, const struct rusage& ru) {
+	auto& r = usage_[script_kind_name(script_kind_of(script))];
+	r.runs++;
+	r.utime   += ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6;
+	r.stime   += ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+	r.maxrss   = max<uint64_t>(r.maxrss, ru.ru_maxrss);
+	r.inblock += ru.ru_inblock;
+	r.oublock += ru.ru_oublock;
+	r.nvcsw   += ru.ru_nvcsw;
+	r.nivcsw  += ru.ru_nivcsw;
+	usage_dirty = true;
+}
+
+bool unit::usage_changed(void) {
+	bool ret = usage_dirty;
+	usage_dirty = false;
+	return ret;
+}
+
+const unit::start_timing& unit::timing(void) { return timing_; }
+
+void unit::unqueue(void) { queued_since = 0; }
+
+void unit::record_start(void) {
+	timing_.queued    = queued_since;
+	timing_.startable = queued_since;
+	timing_.started   = monotime();
+	timing_.ready     = 0;
+	timing_.blocker   = "";
+	queued_since      = 0;
+
+	for (auto& p : depgraph::get_deps(name_))
+		if (p->timing_.ready > timing_.startable) {
+			timing_.startable = p->timing_.ready;
+			timing_.blocker   = p->name();
+		}
+}
+
+
+
+bool unit::request_start(reason_t* reason, map<string, bool>* blocked_memo) {
 	switch (state) {
 		case DOWN:
-			if (blocked()) {
-				if (reason) *reason = "unit blocked";
+			if (!queued_since) queued_since = monotime();
+			if (blocked(blocked_memo)) {
+				if (reason) *reason = reason_t(R_BLOCKED);
 				return false;
 			}
 			if (!can_start(reason))
 				return false;
+			if (!depgraph::may_start(shared_from_this(), reason))
+				return false;
 
-			if (reason) *reason = "now starting";
+			if (reason) *reason = reason_t(R_NOW_STARTING);
+			record_start();
+			cgroup::setup(shared_from_this());
 			step_have_logrot();
 			return true;
 
 		case IN_LOGROT:
 		case IN_START:
 		case IN_RDY:
-			if (reason) *reason = "already starting";
+			if (reason) *reason = reason_t(R_ALREADY_STARTING);
 			return true;
 
 		case UP:
-			if (reason) *reason = "already started";
+			if (reason) *reason = reason_t(R_ALREADY_STARTED);
 			return true;
 
 		case IN_RDY_ERR:
 		case IN_RUN:
 		case IN_STOP:
-			if (reason) *reason = "currently stopping";
+			if (reason) *reason = reason_t(R_CURRENTLY_STOPPING);
 			return false;
 
 		case IN_RESTART:
-			if (reason) *reason = "currently restarting";
+			if (reason) *reason = reason_t(R_CURRENTLY_RESTARTING);
 			return true;
 	}
 	assert(false);
 }
 
-bool unit::request_stop(string* reason) {
+bool unit::request_stop(reason_t* reason) {
 	switch (state) {
 		case DOWN:
-			if (reason) *reason = "already stopped";
+			if (reason) *reason = reason_t(R_ALREADY_STOPPED);
 			return true;
 
 		case IN_LOGROT:
 		case IN_START:
 		case IN_RDY:
-			if (reason) *reason = "currently starting";
+			if (reason) *reason = reason_t(R_CURRENTLY_STARTING);
 			return false;
 
 		case UP:
 			if (!can_stop(reason))
 				return false;
 
-			if (reason) *reason = "now stopping";
+			if (reason) *reason = reason_t(R_NOW_STOPPING);
 			step_active_run();
 			return true;
 
 		case IN_RDY_ERR:
 		case IN_RUN:
 		case IN_STOP:
-			if (reason) *reason = "already stopping";
+			if (reason) *reason = reason_t(R_ALREADY_STOPPING);
 			return true;
 
 		case IN_RESTART:
-			if (reason) *reason = "currently restarting";
+			if (restart_timer) {
+				timer::cancel(restart_timer);
+				restart_timer = 0;
+				set_state(DOWN);
+				if (reason) *reason = reason_t(R_RESTART_CANCELLED);
+				return true;
+			}
+			if (reason) *reason = reason_t(R_CURRENTLY_RESTARTING);
 			return false;
 	}
 	assert(false);
@@ -187,50 +309,371 @@ void unit::handle(string event) {
 				log::err(string("failed to run setsid: ") + strerror(errno));
 				exit(1);
 			}
-			log::debug("fork events/" + event + " as pid " + to_string(getpid()) + " sid " + to_string(sid));
+			cgroup::enter(name(), "events");
+			instance_env();
+			LOG_DEBUG("fork events/" + event + " as pid " + to_string(getpid()) + " sid " + to_string(sid));
 			output_logfile(name() + ".log");
 			log::note("launch ./events/" + event);
 			execl(p.c_str(), p.c_str(), name().c_str(), event.c_str(), (char*) NULL);
 			exit(1);
 		}
 		else if (pid > 0)
-			term_add(pid, on_event_exit, shared_from_this());
+			term_add(pid, on_event_exit, shared_from_this(), "events/" + event);
 	}
 }
 
 
 
 void unit::set_state(state_t state) {
+	if (state != this->state) {
+		uint64_t now = monotime();
+		state_times[this->state] += now - state_since;
+		state_counts[state]++;
+		state_since = now;
+		if (state == UP) timing_.ready = now;
+	}
+
+	if (state != DOWN && teardown_timer) {
+		timer::cancel(teardown_timer);
+		teardown_timer = 0;
+	}
+
+	// processes that escaped their script's process group are given the kill timeout to exit, then killed
+	if (state == DOWN && this->state != DOWN && cgroup::populated(name_)) {
+		weak_ptr<unit> w = shared_from_this();
+		teardown_timer = timer::add(kill_grace(), [w]{
+			with_weak_ptr(w, false, [](shared_ptr<unit> u) {
+				u->teardown_timer = 0;
+				if (u->state == DOWN && cgroup::populated(u->name_)) {
+					log::warn(u->term_name() + ": processes left after the unit went down, killing");
+					cgroup::signal(u->name_, "", SIGKILL);
+				}
+				return true;
+			});
+		});
+	}
+
+	if (state == UP && this->state != UP && has_health()) arm_health();
+	if (state != UP && this->state == UP) stop_health();
+
+	// a scheduled unit without a run script is done once it is ready, and any scheduled unit once it is down
+	if (state == UP && scheduled && !run_pid) end_schedule();
+	if (state == DOWN && scheduled) end_schedule();
+
 	string old_state = state_descr(this->state);
 	string new_state = state_descr(      state);
 
+	if (state != this->state) {
+		if (trace::enabled()) trace::state(name_, this->state, state);
+		flightrec::state(shared_from_this(), this->state, state);
+	}
+
 	if (old_state != new_state) {
 		log::note(term_name() + ": " + term_state_descr(this->state) + " -> " + term_state_descr(state));
 		std::ofstream(statedir / "state" / name_) << new_state << endl;
 	}
 
+	bool changed = state != this->state;
 	this->state = state;
+	if (changed) depgraph::state_changed(shared_from_this());
 }
 
 void unit::step_have_logrot (void) { if (has_logrot_script()) fork_logrot_script(); else step_have_start  (); }
 void unit::step_have_start  (void) { if (has_start_script ()) fork_start_script (); else step_have_run    (); }
 void unit::step_have_run    (void) { if (has_run_script   ()) fork_run_script   (); else step_have_rdy    (); }
-void unit::step_have_rdy    (void) { if (has_rdy_script   ()) fork_rdy_script   (); else set_state(UP)      ; }
+void unit::step_have_rdy    (void) { if (notify_fd != -1    ) wait_notify       (); else step_have_probe  (); }
+void unit::step_have_probe  (void) { if (has_probe        ()) start_probe       (); else step_have_rdy_script(); }
+void unit::step_have_rdy_script(void) { if (has_rdy_script   ()) fork_rdy_script   (); else set_state(UP)      ; }
 void unit::step_active_rdy  (void) { if (rdy_pid != 0       ) kill_rdy_script   (); else step_have_stop   (); }
 void unit::step_active_run  (void) { if (run_pid != 0       ) kill_run_script   (); else step_have_stop   (); }
-void unit::step_have_stop   (void) { if (has_stop_script  ()) fork_stop_script  (); else step_have_restart(); }
+
+// A scheduled run is over once the unit stops for any reason, a failed start must not keep it wanted and restarting.
+void unit::step_have_stop(void) {
+	if (scheduled) end_schedule();
+	if (has_stop_script()) fork_stop_script();
+	else                   step_have_restart();
+}
 
 void unit::step_have_restart(void) {
 	if (needed() && !blocked()) {
-		log::debug(term_name() + ": should be restarted");
+		string why;
+		if (restart_limited(why)) {
+			log::warn(term_name() + ": " + why + ", masking");
+			std::ofstream(statedir / "masked" / name_) << why << endl;
+			set_state(DOWN);
+			// may be called while the stop queue is being processed
+			timer::add(0, []{ depgraph::start_stop_units(); });
+			return;
+		}
+
+		LOG_DEBUG(term_name() + ": should be restarted");
 		fork_restart_script();
 	}
 	else {
-		log::debug(term_name() + ": should not be restarted");
+		LOG_DEBUG(term_name() + ": should not be restarted");
 		set_state(DOWN);
 	}
 }
 
+bool unit::restart_limited(string& why) {
+	path p = config_file("restart-limit");
+	if (p.empty()) return false;
+
+	unsigned count;
+	double   window;
+	if (!(std::ifstream(p) >> count >> window)) {
+		log::warn(term_name() + ": could not parse " + p.string() + ", expected \"<count> <seconds>\"");
+		return false;
+	}
+
+	uint64_t now = monotime();
+	restart_times.push_back(now);
+	while (!restart_times.empty() && now - restart_times.front() > window * 1e9) restart_times.pop_front();
+
+	if (restart_times.size() <= count) return false;
+
+	why = "restart limit exceeded (" + to_string(restart_times.size()) + " restarts within " + to_string((int) window) + "s)";
+	restart_times.clear();
+	return true;
+}
+
+uint64_t unit::restart_delay(void) {
+	static mt19937 rng(random_device{}());
+
+	double initial = 1, max = 60, factor = 2, jitter = 0.1;
+
+	path p = config_file("restart-delay");
+	if (!p.empty()) {
+		std::ifstream in(p);
+		if (!(in >> initial >> max)) {
+			log::warn(term_name() + ": could not parse " + p.string() + ", expected \"<initial> <max> [<factor> [<jitter>]]\"");
+			initial = 1;
+			max     = 60;
+		}
+		else if (in >> factor) in >> jitter;
+	}
+
+	// a unit that stayed ready for longer than the maximum delay is not considered to be crash looping
+	if (timing_.ready && monotime() - timing_.ready >= max * 1e9) restart_streak = 0;
+
+	double delay = initial * pow(factor, restart_streak);
+	if (delay > max) delay = max;
+	else             restart_streak++;
+
+	if (jitter > 0) delay *= 1 + uniform_real_distribution<double>(-jitter, jitter)(rng);
+	if (delay < 0) delay = 0;
+
+	return delay * 1e9;
+}
+
+void unit::finish_restart(bool ok) {
+	set_state(DOWN);
+
+	if (!ok) {
+		LOG_DEBUG(term_name() + ": restart script failed, masking");
+		std::ofstream(statedir / "masked" / name_) << "restart script failed" << endl;
+		depgraph::start_stop_units();
+		return;
+	}
+
+	if (needed() && !blocked()) {
+		LOG_DEBUG(term_name() + ": should still be restarted");
+		depgraph::start(shared_from_this(), false);
+	}
+	else
+		LOG_DEBUG(term_name() + ": should not be restarted anymore");
+
+	depgraph::queue_step();
+}
+
+const unit::schedule_stats& unit::schedule_counts(void) { return sched_stats; }
+
+void unit::reschedule(void) {
+	path p = dir() / "schedule";
+	string f[5];
+	bool have = is_regular_file(p);
+	if (have && !(std::ifstream(p) >> f[0] >> f[1] >> f[2] >> f[3] >> f[4])) {
+		log::warn(term_name() + ": could not parse " + p.string() + ", expected \"<min> <hour> <day> <month> <weekday>\"");
+		have = false;
+	}
+
+	// keep an unchanged schedule, so random values are not rolled again
+	if (have && sched && sched_timer && sched->str() == f[0] + " " + f[1] + " " + f[2] + " " + f[3] + " " + f[4]) return;
+
+	if (sched_timer) timer::cancel(sched_timer);
+	sched_timer = 0;
+	sched.reset();
+	if (!have) return;
+
+	try {
+		sched = make_shared<schedule>(f[0], f[1], f[2], f[3], f[4]);
+	}
+	catch (exception& ex) {
+		log::warn(term_name() + ": could not parse " + p.string() + ": " + ex.what());
+		return;
+	}
+
+	arm_schedule();
+}
+
+void unit::arm_schedule(void) {
+	time_t now = time(0);
+	sched_next = sched->next(now);
+	if (sched_next == -1) {
+		log::warn(term_name() + ": schedule " + sched->str() + " never matches");
+		return;
+	}
+
+	LOG_DEBUG(term_name() + ": next scheduled start in " + to_string(sched_next - now) + "s");
+	weak_ptr<unit> w = shared_from_this();
+	sched_timer = timer::add((sched_next - now) * 1000000000ULL, [w]{
+		with_weak_ptr(w, false, [](shared_ptr<unit> u) {
+			u->sched_timer = 0;
+			u->on_schedule();
+			return true;
+		});
+	});
+}
+
+void unit::on_schedule(void) {
+	// the timers run on the monotonic clock, the realtime clock may have been set back in the meantime
+	if (time(0) < sched_next) {
+		arm_schedule();
+		return;
+	}
+
+	if (in_shutdown) return;
+
+	if (blocked()) {
+		log::note(term_name() + ": skipping scheduled start, unit is blocked");
+		sched_stats.skipped++;
+	}
+	else if (scheduled || running()) {
+		log::note(term_name() + ": skipping scheduled start, unit is still running");
+		sched_stats.skipped++;
+	}
+	else {
+		log::note(term_name() + ": scheduled start");
+		sched_stats.fired++;
+		scheduled = true;
+		depgraph::start_stop_units();
+	}
+
+	arm_schedule();
+}
+
+void unit::end_schedule(void) {
+	LOG_DEBUG(term_name() + ": scheduled run finished");
+	scheduled = false;
+	// may be called from within a queue step
+	timer::add(0, []{ depgraph::start_stop_units(); });
+}
+
+uint64_t unit::script_timeout(const string& script) {
+	path p = config_file("timeout/" + script);
+	if (p.empty()) return 0;
+
+	double secs;
+	if (!(std::ifstream(p) >> secs) || secs <= 0) {
+		log::warn(term_name() + ": could not parse " + p.string() + ", expected a positive number of seconds");
+		return 0;
+	}
+	return secs * 1e9;
+}
+
+void unit::arm_timeout(const string& script, pid_t pid) {
+	timed_out = false;
+
+	uint64_t t = script == "ready" && ready_left ? ready_left : script_timeout(script);
+	if (!t) return;
+
+	weak_ptr<unit> w = shared_from_this();
+	timeout_timer = timer::add(t, [w, script, pid]{
+		with_weak_ptr(w, false, [&script, pid](shared_ptr<unit> u) {
+			u->timeout_timer = 0;
+			u->on_timeout(script, pid);
+			return true;
+		});
+	});
+}
+
+void unit::on_timeout(const string& script, pid_t pid) {
+	if (!timed_out) {
+		log::warn(term_name() + ": " + script + " script timed out, kill(-" + to_string(pid) + ", " + signal_string(SIGTERM) + ")");
+		timed_out = true;
+		exits_[script].timeouts++;
+		kill_script(script, pid, SIGTERM);
+
+		weak_ptr<unit> w = shared_from_this();
+		timeout_timer = timer::add(kill_grace(), [w, script, pid]{
+			with_weak_ptr(w, false, [&script, pid](shared_ptr<unit> u) {
+				u->timeout_timer = 0;
+				u->on_timeout(script, pid);
+				return true;
+			});
+		});
+	}
+	else {
+		log::warn(term_name() + ": " + script + " script ignored " + signal_string(SIGTERM) + ", kill(-" + to_string(pid) + ", " + signal_string(SIGKILL) + ")");
+		kill_script(script, pid, SIGKILL);
+	}
+}
+
+// Waits in IN_RDY for a readiness signal that does not come from a ready script, bounded by timeout/ready.
+void unit::wait_ready(const string& what) {
+	set_state(IN_RDY);
+
+	uint64_t t = ready_left ? ready_left : script_timeout("ready");
+	if (!t) return;
+
+	weak_ptr<unit> w = shared_from_this();
+	timeout_timer = timer::add(t, [w, what]{
+		with_weak_ptr(w, false, [&what](shared_ptr<unit> u) {
+			u->timeout_timer = 0;
+			if (u->state != IN_RDY || u->rdy_pid) return true;
+
+			log::warn(u->term_name() + ": no " + what + " in time");
+			u->exits_["ready"].timeouts++;
+			u->stop_probe();
+			u->step_active_run();
+			depgraph::queue_step();
+			return true;
+		});
+	});
+}
+
+uint64_t unit::kill_grace(void) {
+	double grace = 5;
+	path p = config_file("timeout/kill");
+	if (!p.empty() && !(std::ifstream(p) >> grace)) {
+		log::warn(term_name() + ": could not parse " + p.string() + ", expected a number of seconds");
+		grace = 5;
+	}
+	return grace * 1e9;
+}
+
+// Signals the process group of a script, or with cgroups every process of the script, including those that left the
+// process group.
+void unit::kill_script(const string& script, pid_t pid, int signo) {
+	if (cgroup::enabled()) cgroup::signal(name_, script, signo);
+	else                   backend::current->kill(-pid, signo);
+}
+
+bool unit::script_ok(const string& script, int status) {
+	if (timeout_timer) {
+		timer::cancel(timeout_timer);
+		timeout_timer = 0;
+	}
+
+	bool ok = status_ok(shared_from_this(), script, status);
+	if (timed_out) {
+		log::warn(term_name() + ": " + script + " script failed due to timeout");
+		timed_out = false;
+		return false;
+	}
+	return ok;
+}
+
 void unit::fork_logrot_script(void) {
 	assert(has_logrot_script());
 	log::note(term_name() + ": exec logrotate script");
@@ -246,15 +689,18 @@ void unit::fork_logrot_script(void) {
 			exit(1);
 		}
 		path p = is_regular_file(dir() / "logrotate") ? (dir() / "logrotate") : (confdir / "logrotate");
-		log::debug(string("fork logrotate as pid ") + to_string(getpid()) + " sid " + to_string(sid));
+		cgroup::enter(name(), "logrotate");
+		instance_env();
+		LOG_DEBUG(string("fork logrotate as pid ") + to_string(getpid()) + " sid " + to_string(sid));
 		output_logfile(name() + ".log");
 		log::note("launch ./logrotate");
 		execl(p.c_str(), p.c_str(), name().c_str(), (char*) NULL);
 		exit(1);
 	}
 	else if (pid > 0) {
-		term_add(pid, on_logrot_exit, shared_from_this());
+		term_add(pid, on_logrot_exit, shared_from_this(), "logrotate");
 		logrot_pid = pid;
+		arm_timeout("logrotate", pid);
 		set_state(IN_LOGROT);
 	}
 }
@@ -273,15 +719,18 @@ void unit::fork_start_script(void) {
 			log::err(string("failed to run setsid: ") + strerror(errno));
 			exit(1);
 		}
-		log::debug(string("fork start as pid ") + to_string(getpid()) + " sid " + to_string(sid));
+		cgroup::enter(name(), "start");
+		instance_env();
+		LOG_DEBUG(string("fork start as pid ") + to_string(getpid()) + " sid " + to_string(sid));
 		output_logfile(name() + ".log");
 		log::note("launch ./start");
 		execl((dir() / "start").c_str(), (dir() / "start").c_str(), (char*) NULL);
 		exit(1);
 	}
 	else if (pid > 0) {
-		term_add(pid, on_start_exit, shared_from_this());
+		term_add(pid, on_start_exit, shared_from_this(), "start");
 		start_pid = pid;
+		arm_timeout("start", pid);
 		set_state(IN_START);
 	}
 }
@@ -289,6 +738,7 @@ void unit::fork_start_script(void) {
 void unit::fork_run_script(void) {
 	assert(has_run_script());
 	log::note(term_name() + ": exec run script");
+	if (has_notify()) open_notify();
 	pid_t pid = fork_();
 	if (pid == 0) {
 		if (chdir(dir().c_str()) == -1) {
@@ -300,14 +750,22 @@ void unit::fork_run_script(void) {
 			log::err(string("failed to run setsid: ") + strerror(errno));
 			exit(1);
 		}
-		log::debug(string("fork run as pid ") + to_string(getpid()) + " sid " + to_string(sid));
+		cgroup::enter(name(), "run");
+		instance_env();
+		LOG_DEBUG(string("fork run as pid ") + to_string(getpid()) + " sid " + to_string(sid));
 		output_logfile(name() + ".log");
+		pass_notify();
+		pass_sockets();
 		log::note("launch ./run");
 		execl((dir() / "run").c_str(), (dir() / "run").c_str(), (char*) NULL);
 		exit(1);
 	}
 	else if (pid > 0) {
-		term_add(pid, on_run_exit, shared_from_this());
+		if (notify_w != -1) {
+			close(notify_w);
+			notify_w = -1;
+		}
+		term_add(pid, on_run_exit, shared_from_this(), "run");
 		run_pid = pid;
 		std::ofstream(statedir / "pid" / name()) << pid << endl;
 		step_have_rdy();
@@ -328,15 +786,18 @@ void unit::fork_rdy_script(void) {
 			log::err(string("failed to run setsid: ") + strerror(errno));
 			exit(1);
 		}
-		log::debug(string("fork ready as pid ") + to_string(getpid()) + " sid " + to_string(sid));
+		cgroup::enter(name(), "ready");
+		instance_env();
+		LOG_DEBUG(string("fork ready as pid ") + to_string(getpid()) + " sid " + to_string(sid));
 		output_logfile(name() + ".log");
 		log::note("launch ./ready");
 		execl((dir() / "ready").c_str(), (dir() / "ready").c_str(), (char*) NULL);
 		exit(1);
 	}
 	else if (pid > 0) {
-		term_add(pid, on_rdy_exit, shared_from_this());
+		term_add(pid, on_rdy_exit, shared_from_this(), "ready");
 		rdy_pid = pid;
+		arm_timeout("ready", pid);
 		set_state(IN_RDY);
 	}
 }
@@ -355,29 +816,41 @@ void unit::fork_stop_script(void) {
 			log::err(string("failed to run setsid: ") + strerror(errno));
 			exit(1);
 		}
-		log::debug(string("fork stop as pid ") + to_string(getpid()) + " sid " + to_string(sid));
+		cgroup::enter(name(), "stop");
+		instance_env();
+		LOG_DEBUG(string("fork stop as pid ") + to_string(getpid()) + " sid " + to_string(sid));
 		output_logfile(name() + ".log");
 		log::note("launch ./stop");
 		execl((dir() / "stop").c_str(), (dir() / "stop").c_str(), (char*) NULL);
 		exit(1);
 	}
 	else if (pid > 0) {
-		term_add(pid, on_stop_exit, shared_from_this());
+		term_add(pid, on_stop_exit, shared_from_this(), "stop");
 		stop_pid = pid;
+		arm_timeout("stop", pid);
 		set_state(IN_STOP);
 	}
 }
 
 void unit::fork_restart_script(void) {
-	bool use_script;
-	if (has_restart_script()) {
-		use_script = true;
-		log::note(term_name() + ": exec restart script");
-	}
-	else {
-		use_script = false;
-		log::note(term_name() + ": no ./restart script, exec sleep 5");
+	if (!has_restart_script()) {
+		uint64_t delay = restart_delay();
+		log::note(term_name() + ": no ./restart script, restart in " + to_string(delay / 1000000) + "ms");
+
+		weak_ptr<unit> w = shared_from_this();
+		restart_timer = timer::add(delay, [w]{
+			with_weak_ptr(w, false, [](shared_ptr<unit> u) {
+				assert(u->state == IN_RESTART);
+				u->restart_timer = 0;
+				u->finish_restart(true);
+				return true;
+			});
+		});
+		set_state(IN_RESTART);
+		return;
 	}
+
+	log::note(term_name() + ": exec restart script");
 	pid_t pid = fork_();
 	if (pid == 0) {
 		if (chdir(dir().c_str()) == -1) {
@@ -389,36 +862,33 @@ void unit::fork_restart_script(void) {
 			log::err(string("failed to run setsid: ") + strerror(errno));
 			exit(1);
 		}
-		log::debug(string("fork restart as pid ") + to_string(getpid()) + " sid " + to_string(sid));
+		cgroup::enter(name(), "restart");
+		instance_env();
+		LOG_DEBUG(string("fork restart as pid ") + to_string(getpid()) + " sid " + to_string(sid));
 		output_logfile(name() + ".log");
-		if (use_script) {
-			log::note("launch ./restart");
-			execl((dir() / "restart").c_str(), (dir() / "restart").c_str(), (char*) NULL);
-		}
-		else {
-			log::note("launch sleep 5");
-			execlp("sleep", "sleep", "5", (char*) NULL);
-		}
+		log::note("launch ./restart");
+		execl((dir() / "restart").c_str(), (dir() / "restart").c_str(), (char*) NULL);
 		exit(1);
 	}
 	else if (pid > 0) {
-		term_add(pid, on_restart_exit, shared_from_this());
+		term_add(pid, on_restart_exit, shared_from_this(), "restart");
 		restart_pid = pid;
+		arm_timeout("restart", pid);
 		set_state(IN_RESTART);
 	}
 }
 
 void unit::kill_rdy_script(void) {
 	assert(rdy_pid);
-	log::debug(term_name() + ": kill(" + to_string(rdy_pid) + ", " + signal_string(SIGTERM) + ")");
-	kill(rdy_pid, SIGTERM);
+	LOG_DEBUG(term_name() + ": kill(" + to_string(rdy_pid) + ", " + signal_string(SIGTERM) + ")");
+	backend::current->kill(rdy_pid, SIGTERM);
 	set_state(IN_RDY_ERR);
 }
 
 void unit::kill_run_script(void) {
 	assert(run_pid);
-	log::debug(term_name() + ": kill(" + to_string(run_pid) + ", " + signal_string(SIGTERM) + ")");
-	kill(run_pid, SIGTERM);
+	LOG_DEBUG(term_name() + ": kill(" + to_string(run_pid) + ", " + signal_string(SIGTERM) + ")");
+	backend::current->kill(run_pid, SIGTERM);
 	set_state(IN_RUN);
 }
 
@@ -428,11 +898,11 @@ void unit::kill_run_script(void) {
 	void unit::on_logrot_exit(pid_t pid, shared_ptr<unit> u, int status) {
 		assert(u->state == IN_LOGROT);
 
-		log::debug(u->term_name() + ": kill(-" + to_string(u->logrot_pid) + ", " + signal_string(SIGTERM) + ")");
-		kill(-u->logrot_pid, SIGTERM);
+		LOG_DEBUG(u->term_name() + ": kill(-" + to_string(u->logrot_pid) + ", " + signal_string(SIGTERM) + ")");
+		u->kill_script("logrotate", u->logrot_pid, SIGTERM);
 		u->logrot_pid = 0;
 
-		if (status_ok(u, "logrotate", status))
+		if (u->script_ok("logrotate", status))
 			u->step_have_start();
 		else
 			u->set_state(DOWN);
@@ -443,11 +913,11 @@ void unit::kill_run_script(void) {
 	void unit::on_start_exit(pid_t pid, shared_ptr<unit> u, int status) {
 		assert(u->state == IN_START);
 
-		log::debug(u->term_name() + ": kill(-" + to_string(u->start_pid) + ", " + signal_string(SIGTERM) + ")");
-		kill(-u->start_pid, SIGTERM);
+		LOG_DEBUG(u->term_name() + ": kill(-" + to_string(u->start_pid) + ", " + signal_string(SIGTERM) + ")");
+		u->kill_script("start", u->start_pid, SIGTERM);
 		u->start_pid = 0;
 
-		if (status_ok(u, "start", status))
+		if (u->script_ok("start", status))
 			u->step_have_run();
 		else
 			u->step_have_stop();
@@ -456,20 +926,26 @@ void unit::kill_run_script(void) {
 	}
 
 	void unit::on_rdy_exit(pid_t pid, shared_ptr<unit> u, int status) {
-		log::debug(u->term_name() + ": kill(-" + to_string(u->rdy_pid) + ", " + signal_string(SIGTERM) + ")");
-		kill(-u->rdy_pid, SIGTERM);
+		// superseded by a ready notification
+		if (pid != u->rdy_pid) {
+			u->record_exit("ready", status);
+			return;
+		}
+
+		LOG_DEBUG(u->term_name() + ": kill(-" + to_string(u->rdy_pid) + ", " + signal_string(SIGTERM) + ")");
+		u->kill_script("ready", u->rdy_pid, SIGTERM);
 		u->rdy_pid = 0;
 
 		switch (u->state) {
 			case IN_RDY:
-				if (status_ok(u, "ready", status))
+				if (u->script_ok("ready", status))
 					u->set_state(UP);
 				else
 					u->step_active_run();
 			break;
 
 			case IN_RDY_ERR:
-				status_ok(u, "ready", status);
+				u->script_ok("ready", status);
 				u->step_have_stop();
 			break;
 
@@ -481,10 +957,13 @@ void unit::kill_run_script(void) {
 	}
 
 	void unit::on_run_exit(pid_t pid, shared_ptr<unit> u, int status) {
-		log::debug(u->term_name() + ": kill(-" + to_string(u->run_pid) + ", " + signal_string(SIGTERM) + ")");
-		kill(-u->run_pid, SIGTERM);
+		LOG_DEBUG(u->term_name() + ": kill(-" + to_string(u->run_pid) + ", " + signal_string(SIGTERM) + ")");
+		u->kill_script("run", u->run_pid, SIGTERM);
 		u->run_pid = 0;
 		remove(statedir / "pid" / u->name());
+		u->close_notify();
+		u->stop_probe();
+		if (u->scheduled) u->end_schedule();
 
 		switch (u->state) {
 			case IN_RDY:
@@ -508,11 +987,11 @@ void unit::kill_run_script(void) {
 	void unit::on_stop_exit(pid_t pid, shared_ptr<unit> u, int status) {
 		assert(u->state == IN_STOP);
 
-		log::debug(u->term_name() + ": kill(-" + to_string(u->stop_pid) + ", " + signal_string(SIGTERM) + ")");
-		kill(-u->stop_pid, SIGTERM);
+		LOG_DEBUG(u->term_name() + ": kill(-" + to_string(u->stop_pid) + ", " + signal_string(SIGTERM) + ")");
+		u->kill_script("stop", u->stop_pid, SIGTERM);
 		u->stop_pid = 0;
 
-		status_ok(u, "stop", status);
+		u->script_ok("stop", status);
 		u->step_have_restart();
 
 		depgraph::queue_step();
@@ -521,34 +1000,16 @@ void unit::kill_run_script(void) {
 	void unit::on_restart_exit(pid_t pid, shared_ptr<unit> u, int status) {
 		assert(u->state == IN_RESTART);
 
-		log::debug(u->term_name() + ": kill(-" + to_string(u->restart_pid) + ", " + signal_string(SIGTERM) + ")");
-		kill(-u->restart_pid, SIGTERM);
+		LOG_DEBUG(u->term_name() + ": kill(-" + to_string(u->restart_pid) + ", " + signal_string(SIGTERM) + ")");
+		u->kill_script("restart", u->restart_pid, SIGTERM);
 		u->restart_pid = 0;
 
-		status_ok(u, "restart", status);
-
-		u->set_state(DOWN);
-
-		if ((WIFEXITED(status) && WEXITSTATUS(status) != 0) || WIFSIGNALED(status)) {
-			log::debug(u->term_name() + ": restart script failed, masking");
-			ofstream(statedir / "masked" / u->name()).close();
-			depgraph::start_stop_units();
-			return;
-		}
-
-		if (u->needed() && !u->blocked()) {
-			log::debug(u->term_name() + ": should still be restarted");
-			depgraph::start(u, false);
-		}
-		else
-			log::debug(u->term_name() + ": should not be restarted anymore");
-
-		depgraph::queue_step();
+		u->finish_restart(u->script_ok("restart", status));
 	}
 
 	void unit::on_event_exit(pid_t pid, shared_ptr<unit> u, int status) {
-		log::debug(u->term_name() + ": kill(-" + to_string(pid) + ", " + signal_string(SIGTERM) + ")");
-		kill(-pid, SIGTERM);
+		LOG_DEBUG(u->term_name() + ": kill(-" + to_string(pid) + ", " + signal_string(SIGTERM) + ")");
+		backend::current->kill(-pid, SIGTERM);
 	}
 
 #pragma GCC diagnostic pop
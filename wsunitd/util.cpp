@@ -1,37 +1,141 @@
 #include "wsunitd.hpp"
 
+#include <condition_variable>
 #include <iostream>
+#include <mutex>
+#include <thread>
 
 #include <fcntl.h>
 #include <signal.h>
+#include <sys/wait.h>
+#include <time.h>
 
 
 
+path confdir ;
+path statedir;
+path logdir  ;
+bool in_shutdown;
+uint64_t started_at;
+
+
+
+void mkdirs(void) {
+	if (!is_directory(confdir              )) create_directories(confdir              );
+	if (!is_directory(confdir / "@default" )) create_directories(confdir / "@default" );
+	if (!is_directory(confdir / "@shutdown")) create_directories(confdir / "@shutdown");
+	if (!is_directory(statedir             )) create_directories(statedir             );
+	if (!is_directory(statedir / "wanted"  )) create_directories(statedir / "wanted"  );
+	if (!is_directory(statedir / "masked"  )) create_directories(statedir / "masked"  );
+	if (!is_directory(statedir / "state"   )) create_directories(statedir / "state"   );
+	if (!is_directory(statedir / "pid"     )) create_directories(statedir / "pid"     );
+	if (!is_directory(statedir / "usage"   )) create_directories(statedir / "usage"   );
+	if (!is_directory(statedir / "health"  )) create_directories(statedir / "health"  );
+	if (!is_directory(logdir               )) create_directories(logdir               );
+}
+
 bool log::verbose;
-void log::debug(string s) { if (verbose) cerr << "[ \x1b[90mdebug\x1b[0m   ] " + s + "\n"; }
-void log::note (string s) {              cerr << "[ \x1b[36mnote\x1b[0m    ] " + s + "\n"; }
-void log::warn (string s) {              cerr << "[ \x1b[33mwarning\x1b[0m ] " + s + "\n"; }
-void log::err  (string s) {              cerr << "[ \x1b[31merror\x1b[0m   ] " + s + "\n"; }
-void log::fatal(string s) {              cerr << "[ \x1b[41mfatal\x1b[0m   ] " + s + "\n"; }
+void log::debug(const string& s) { if (verbose) write("[ \x1b[90mdebug\x1b[0m   ] " + s + "\n"); }
+void log::note (const string& s) {              write("[ \x1b[36mnote\x1b[0m    ] " + s + "\n"); }
+void log::warn (const string& s) {              write("[ \x1b[33mwarning\x1b[0m ] " + s + "\n"); }
+void log::err  (const string& s) {              write("[ \x1b[31merror\x1b[0m   ] " + s + "\n"); }
+void log::fatal(const string& s) {              write("[ \x1b[41mfatal\x1b[0m   ] " + s + "\n"); flush(); flightrec::dump(); }
 
-pid_t fork_(void) {
-	pid_t pid = fork();
-
-	if (pid == 0) {
-		sigset_t sigs;
-		assert(sigemptyset(&sigs) == 0);
-		assert(sigaddset(&sigs, SIGUSR1) == 0);
-		assert(sigaddset(&sigs, SIGUSR2) == 0);
-		assert(sigaddset(&sigs, SIGCHLD) == 0);
-		assert(sigaddset(&sigs, SIGTERM) == 0);
-		assert(sigaddset(&sigs, SIGINT ) == 0);
-		assert(sigprocmask(SIG_UNBLOCK, &sigs, 0) == 0);
+// Messages are appended to a bounded buffer and written to stderr by a separate thread, so that a slow console or log
+// file cannot stall the main loop. Forked children write directly, as the thread does not exist there.
+
+struct log_sink {
+	mutex              buf_mtx;
+	mutex              out_mtx;
+	condition_variable cv;
+	string             buf;
+	size_t             dropped = 0;
+};
+
+static const size_t log_sink_max = 1 << 20;
+
+// allocated on first use and never destroyed, as the writer thread may still run during exit()
+static log_sink* sink   = 0;
+static bool      direct = false;
+
+void log::write(const string& s) {
+	if (direct) {
+		cerr << s;
+		return;
+	}
+
+	if (!sink) {
+		// the writer thread must not receive any of the signals meant for the signalfd
+		sigset_t all, old;
+		sigfillset(&all);
+		pthread_sigmask(SIG_BLOCK, &all, &old);
+		sink = new log_sink;
+		thread(writer).detach();
+		pthread_sigmask(SIG_SETMASK, &old, 0);
+		atexit(flush);
+	}
+
+	{
+		lock_guard<mutex> l(sink->buf_mtx);
+		if (sink->buf.size() + s.size() > log_sink_max) {
+			sink->dropped++;
+			return;
+		}
+		sink->buf += s;
+	}
+	sink->cv.notify_one();
+}
+
+void log::flush(void) {
+	if (direct || !sink) return;
+	lock_guard<mutex> o(sink->out_mtx);
+	drain();
+}
+
+void log::forked(void) {
+	direct = true;
+}
+
+void log::drain(void) {
+	string out;
+	size_t dropped;
+
+	{
+		lock_guard<mutex> l(sink->buf_mtx);
+		out.swap(sink->buf);
+		dropped = sink->dropped;
+		sink->dropped = 0;
+	}
+
+	if (dropped) out = "[ \x1b[33mwarning\x1b[0m ] " + to_string(dropped) + " log messages dropped\n" + out;
+
+	const char* p = out.data();
+	size_t      l = out.size();
+	while (l > 0) {
+		ssize_t n = ::write(2, p, l);
+		if (n == -1) {
+			if (errno == EINTR) continue;
+			break;
+		}
+		p += n;
+		l -= n;
 	}
+}
 
-	else if (pid < 0)
-		log::warn(string("could not fork: ") + strerror(errno));
+void log::writer(void) {
+	for (;;) {
+		{
+			unique_lock<mutex> l(sink->buf_mtx);
+			sink->cv.wait(l, []{ return !sink->buf.empty() || sink->dropped; });
+		}
 
-	return pid;
+		lock_guard<mutex> o(sink->out_mtx);
+		drain();
+	}
+}
+
+pid_t fork_(void) {
+	return backend::current->fork();
 }
 
 void output_logfile(const string name) {
@@ -51,6 +155,8 @@ void output_logfile(const string name) {
 }
 
 bool status_ok(shared_ptr<unit> u, const string scriptname, int status) {
+	u->record_exit(scriptname, status);
+
 	if (WIFEXITED(status)) {
 		if (WEXITSTATUS(status) == 0) {
 			log::note(u->term_name() + ": " + scriptname + " script exited with code " + to_string(WEXITSTATUS(status)));
@@ -78,20 +184,86 @@ string signal_string(int signum) {
 	#endif
 }
 
-map<pid_t, pair<term_handler, shared_ptr<unit>>> term_map;
+uint64_t monotime(void) {
+	return backend::current->now();
+}
+
+class system_backend : public backend {
+	public:
+		uint64_t now(void) override {
+			struct timespec ts;
+			clock_gettime(CLOCK_MONOTONIC, &ts);
+			return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+		}
+
+		pid_t fork(void) override {
+			pid_t pid = ::fork();
+
+			if (pid == 0) {
+				log::forked();
+
+				sigset_t sigs;
+				assert(sigemptyset(&sigs) == 0);
+				assert(sigaddset(&sigs, SIGUSR1) == 0);
+				assert(sigaddset(&sigs, SIGUSR2) == 0);
+				assert(sigaddset(&sigs, SIGCHLD) == 0);
+				assert(sigaddset(&sigs, SIGTERM) == 0);
+				assert(sigaddset(&sigs, SIGINT ) == 0);
+				assert(sigaddset(&sigs, SIGQUIT) == 0);
+				assert(sigaddset(&sigs, SIGHUP ) == 0);
+				assert(sigprocmask(SIG_UNBLOCK, &sigs, 0) == 0);
+			}
+
+			else if (pid < 0)
+				log::warn(string("could not fork: ") + strerror(errno));
+
+			return pid;
+		}
+
+		#pragma GCC diagnostic push
+			#pragma GCC diagnostic ignored "-Wunused-parameter"
+			void spawned(pid_t pid, shared_ptr<unit> u, const string& script) override {}
+		#pragma GCC diagnostic pop
+
+		int kill(pid_t pid, int signo) override { return ::kill(pid, signo); }
+
+		void reap(void) override {
+			int status;
+			struct rusage ru;
+			pid_t pid;
+			while ((pid = wait4(-1, &status, WNOHANG, &ru)) > 0) term_handle(pid, status, ru);
+		}
+};
+
+static system_backend system_backend_;
+backend* backend::current = &system_backend_;
+
+struct child {
+	term_handler     h;
+	shared_ptr<unit> u;
+	string           script;
+	uint64_t         forked;
+};
+
+map<pid_t, child> term_map;
 
-void term_add(pid_t pid, term_handler h, shared_ptr<unit> u) {
+void term_add(pid_t pid, term_handler h, shared_ptr<unit> u, const string& script) {
 	assert(term_map.count(pid) == 0);
-	term_map.emplace(pid, pair<term_handler, shared_ptr<unit>>(h, u));
+	term_map.emplace(pid, child{h, u, script, monotime()});
+	backend::current->spawned(pid, u, script);
+	flightrec::spawn(u, script, pid);
 }
 
-void term_handle(pid_t pid, int status) {
+void term_handle(pid_t pid, int status, const struct rusage& ru) {
 	if (term_map.count(pid) > 0) {
-		log::debug("handle termination of child process " + to_string(pid));
-		auto [h, u] = term_map.at(pid);
+		LOG_DEBUG("handle termination of child process " + to_string(pid));
+		auto c = term_map.at(pid);
 		term_map.erase(pid);
-		h(pid, u, status);
+		if (trace::enabled()) trace::span(c.u->name(), c.script, pid, c.forked, monotime(), status);
+		flightrec::exit(c.u, c.script, pid, status);
+		c.u->record_usage(c.script, ru);
+		c.h(pid, c.u, status);
 	}
 	else
-		log::debug("ignore termination of child process " + to_string(pid));
+		LOG_DEBUG("ignore termination of child process " + to_string(pid));
 }
@@ -1,13 +1,24 @@
 #pragma once
 
+#include <cstdint>
 #include <deque>
+#include <functional>
+#include <list>
 #include <map>
 #include <memory>
+#include <set>
+#include <unordered_map>
+#include <vector>
 
+#include <sys/epoll.h>
+#include <sys/resource.h>
 #include <sys/types.h>
 
 #include <boost/filesystem.hpp>
 
+#include "flightrec.hpp"
+#include "../unittool/schedule.hpp"
+
 using namespace std;
 using namespace boost;
 using namespace boost::filesystem;
@@ -16,28 +27,48 @@ extern path confdir;
 extern path statedir;
 extern path logdir;
 extern bool in_shutdown;
+extern uint64_t started_at;
+
+class unit;
+class probe;
+
+typedef uint64_t timer_id;
+
+struct reason_t {
+	reason_code      code;
+	shared_ptr<unit> other;
+
+	reason_t(reason_code code = R_UNKNOWN, shared_ptr<unit> other = 0) : code(code), other(other) {}
+	string str(void) const;
+};
 
 class unit : public enable_shared_from_this<unit> {
 	private:
-		unit(string name);
+		unit(string name, string tmpl);
 
 	public:
-		static shared_ptr<unit> create(string name) { return shared_ptr<unit>(new unit(name)); }
+		static shared_ptr<unit> create(string name, string tmpl = "") { return shared_ptr<unit>(new unit(name, tmpl)); }
+		~unit(void);
 
 		string name     (void);
 		string term_name(void);
-		path   dir      (void);
+		path   dir      (void); // of the template for instances
+		string instance (void);
 		bool   running  (void);
 		bool   ready    (void);
 
 		bool wanted     (void);
 		bool needed     (void);
 		bool masked     (void);
-		bool blocked    (void);
-		bool can_start  (string* reason = 0);
-		bool can_stop   (string* reason = 0);
+		bool blocked    (map<string, bool>* memo = 0);
+		bool can_start  (reason_t* reason = 0);
+		bool can_stop   (reason_t* reason = 0);
 		bool need_settle(void);
 
+		// needed() && !blocked() as of the last depgraph::start_stop_units()
+		bool target    (void);
+		void set_target(bool target);
+
 		bool has_logrot_script (void);
 		bool has_start_script  (void);
 		bool has_run_script    (void);
@@ -45,19 +76,87 @@ class unit : public enable_shared_from_this<unit> {
 		bool has_stop_script   (void);
 		bool has_restart_script(void);
 
+		path config_file(const string& name);
+
+		static string template_of(const string& name); // "worker@" for "worker@1", empty if not an instance
+		static bool   is_template(const string& name);
+
 		enum state_t { DOWN, IN_LOGROT, IN_START, IN_RDY, UP, IN_RDY_ERR, IN_RUN, IN_STOP, IN_RESTART };
+		static const int n_states = IN_RESTART + 1;
 		enum state_t get_state(void);
+		static string state_name      (state_t state);
 		static string state_descr     (state_t state);
 		static string term_state_descr(state_t state);
 
-		bool request_start(string* reason = 0);
-		bool request_stop (string* reason = 0);
+		struct exit_stats {
+			uint64_t runs;
+			uint64_t failures;
+			uint64_t timeouts;
+			int      last_status;
+		};
+
+		uint64_t state_count   (state_t state);
+		uint64_t state_duration(state_t state);
+		const map<string, exit_stats>& exits(void);
+		void record_exit(const string& script, int status);
+
+		struct usage_stats {
+			uint64_t runs;
+			double   utime;   // s
+			double   stime;   // s
+			uint64_t maxrss;  // KiB, largest of all runs
+			uint64_t inblock;
+			uint64_t oublock;
+			uint64_t nvcsw;
+			uint64_t nivcsw;
+		};
+
+		const map<string, usage_stats>& usage(void);
+		void record_usage(const string& script, const struct rusage& ru);
+		bool usage_changed(void); // since the last call
+
+		struct start_timing {
+			uint64_t queued;
+			uint64_t startable;
+			uint64_t started;
+			uint64_t ready;
+			string   blocker;
+		};
+
+		const start_timing& timing(void);
+		void                unqueue(void); // left the start queue without starting
+
+		struct schedule_stats {
+			uint64_t fired;
+			uint64_t skipped;
+		};
+
+		const schedule_stats& schedule_counts(void);
+
+		struct health_stats {
+			uint64_t checks;
+			uint64_t failures;
+			unsigned failing; // consecutive failures
+			uint64_t latency; // ns, of the last check
+			uint64_t stops;   // times the unit was stopped for being unhealthy
+		};
+
+		const health_stats& health(void);
+		void reschedule(void);
+
+		void bind_sockets (void);
+		bool sockets_bound(void);
+
+		bool request_start(reason_t* reason = 0, map<string, bool>* blocked_memo = 0);
+		bool request_stop (reason_t* reason = 0);
 
 		void handle(string event);
 
 	private:
 		const string name_;
+		const string template_; // of an instance, empty for a unit with its own directory
 		state_t state;
+		bool    target_;
 
 		pid_t  logrot_pid;
 		pid_t   start_pid;
@@ -66,18 +165,103 @@ class unit : public enable_shared_from_this<unit> {
 		pid_t    stop_pid;
 		pid_t restart_pid;
 
+		timer_id        restart_timer;
+		unsigned        restart_streak;
+		deque<uint64_t> restart_times;
+
+		timer_id timeout_timer;
+		bool     timed_out;
+		uint64_t ready_left; // of timeout/ready, carried over to the fallback of the notify fd
+		timer_id teardown_timer;
+
+		shared_ptr<schedule> sched;
+		timer_id             sched_timer;
+		time_t               sched_next;
+		bool                 scheduled;
+		schedule_stats       sched_stats;
+
+		struct socket_t {
+			string spec;
+			int    fd;
+		};
+
+		map<string, socket_t> sockets;
+
+		int notify_fd;
+		int notify_w;
+
+		shared_ptr<probe> probe_;
+
+		timer_id          health_timer;
+		timer_id          health_timeout;
+		pid_t             health_pid;
+		shared_ptr<probe> health_probe;
+		uint64_t          health_started;
+		bool              health_timedout;
+		health_stats      health_;
+
+		uint64_t state_since;
+		uint64_t state_counts[n_states];
+		uint64_t state_times [n_states];
+		map<string, exit_stats> exits_;
+		map<string, usage_stats> usage_;
+		bool                     usage_dirty;
+
+		uint64_t     queued_since;
+		start_timing timing_;
+
 		void set_state(state_t state);
+		void record_start(void);
+		void instance_env(void);
 
 	private:
 		void step_have_logrot (void);
 		void step_have_start  (void);
 		void step_have_run    (void);
 		void step_have_rdy    (void);
+		void step_have_probe  (void);
+		void step_have_rdy_script(void);
 		void step_active_rdy  (void);
 		void step_active_run  (void);
 		void step_have_stop   (void);
 		void step_have_restart(void);
 
+		bool     restart_limited(string& why);
+		uint64_t restart_delay  (void);
+		void     finish_restart (bool ok);
+
+		uint64_t script_timeout(const string& script);
+		void arm_timeout(const string& script, pid_t pid);
+		void wait_ready (const string& what);
+		void on_timeout (const string& script, pid_t pid);
+		bool script_ok  (const string& script, int status);
+		void kill_script(const string& script, pid_t pid, int signo);
+		uint64_t kill_grace(void);
+
+		void arm_schedule(void);
+		void on_schedule (void);
+		void end_schedule(void);
+
+		void pass_sockets(void);
+
+		bool has_notify   (void);
+		void open_notify  (void);
+		void pass_notify  (void);
+		void close_notify (void);
+		void wait_notify  (void);
+		void on_notify    (const string& line);
+		void on_notify_eof(void);
+
+		friend class notify_handler;
+		friend class reexec;
+
+		void adopt_notify(int fd);
+
+		bool has_probe  (void);
+		void start_probe(void);
+		void stop_probe (void);
+		void on_probe   (bool ok, const string& why);
+
 		void fork_logrot_script (void);
 		void fork_start_script  (void);
 		void fork_run_script    (void);
@@ -85,6 +269,13 @@ class unit : public enable_shared_from_this<unit> {
 		void fork_stop_script   (void);
 		void fork_restart_script(void);
 
+		bool has_health   (void);
+		void health_config(double& interval, double& timeout, unsigned& failures);
+		void arm_health   (void);
+		void run_health   (void);
+		void stop_health  (void);
+		void on_health    (bool ok, const string& why);
+
 		void kill_rdy_script(void);
 		void kill_run_script(void);
 
@@ -95,6 +286,7 @@ class unit : public enable_shared_from_this<unit> {
 		static void on_stop_exit   (pid_t pid, shared_ptr<unit> u, int status);
 		static void on_restart_exit(pid_t pid, shared_ptr<unit> u, int status);
 		static void on_event_exit  (pid_t pid, shared_ptr<unit> u, int status);
+		static void on_health_exit (pid_t pid, shared_ptr<unit> u, int status);
 };
 
 class depgraph {
@@ -108,10 +300,14 @@ class depgraph {
 		static void handle(string event);
 
 		static void queue_step(void);
-		static bool is_settled(string* reason = 0);
+		static bool is_settled(reason_t* reason = 0);
+		static void state_changed(shared_ptr<unit> u);
+		static bool may_start(shared_ptr<unit> u, reason_t* reason = 0);
+		static bool socket_dep(const string& name, const string& dep);
 
 		static void report(void);
 
+		static vector<shared_ptr<unit>> get_units  (void);
 		static vector<shared_ptr<unit>> get_deps   (string name);
 		static vector<shared_ptr<unit>> get_revdeps(string name);
 
@@ -128,6 +324,60 @@ class depgraph {
 		static bool contains(const vector<weak_ptr<node>>& v, const string& name);
 
 		static map<string, shared_ptr<node>> nodes;
+		static set<string>                   unsettled;
+		static set<string>                   starting;
+
+		static void settle_update(shared_ptr<unit> u);
+
+		static int                 start_limit; // -1: derived from load, 0: unlimited
+		static unsigned            start_slots;
+		static map<string, double> durations;   // s, from starting to ready
+		static bool                durations_dirty;
+		static map<string, double> priority;
+
+		static void     read_start_limit(void);
+		static unsigned current_start_limit(void);
+		static void     load_durations(void);
+		static void     save_durations(void);
+		static void     prioritize(void);
+		static double   chain(const string& name, map<string, double>& memo);
+
+		struct stamp {
+			uint64_t ino  = 0;
+			int64_t  sec  = 0;
+			int64_t  nsec = 0;
+
+			bool operator==(const stamp& o) const;
+		};
+
+		// what a unit declares on disk: whether it is a directory, and the contents of deps, revdeps, socket-deps and
+		// socket-revdeps, along with the stamps of these five directories
+		struct decl {
+			bool        dir = false;
+			stamp       stamps[5];
+			set<string> names[4];
+		};
+
+		enum { D_DEPS, D_REVDEPS, D_SOCKET_DEPS, D_SOCKET_REVDEPS };
+		static const char* const decl_dirs[4];
+
+		static map<string, decl> decls;
+		static set<string>       listed;
+		static stamp             listed_stamp;
+		static bool              cache_partial;
+
+		static stamp stamp_of(const path& p, bool* is_dir = 0);
+		static decl  read_decl(const string& name);
+		static bool  settled(const stamp& s);
+		static bool  fresh(const string& name, const decl& d);
+		static bool  scan(void);
+		static bool  declared(const string& name, int kind, const string& other);
+		static bool  is_unit_dir(const string& name);
+
+		static map<string, decl> instances; // of templates, derived from the template's decl
+		static void instantiate(void);
+		static void  load_cache(void);
+		static void  save_cache(void);
 
 		static void del_old_units(void);
 		static void add_new_units(void);
@@ -150,16 +400,180 @@ class depgraph {
 		static void write_state(void);
 };
 
+class reexec {
+	public:
+		static void init   (char** argv);
+		static void request(void);
+		static void poll   (void);
+
+		// in the new instance: read the state left by the previous one, restore each unit before its sockets are bound
+		static bool load   (void);
+		static void restore(shared_ptr<unit> u);
+		static void finish (void);
+
+	private:
+		struct saved {
+			unit::state_t                  state          = unit::DOWN;
+			pid_t                          run_pid        = 0;
+			int                            notify_fd      = -1;
+			unsigned                       restart_streak = 0;
+			uint64_t                       state_since    = 0;
+			deque<uint64_t>                restart_times;
+			uint64_t                       state_counts[unit::n_states] = {};
+			uint64_t                       state_times [unit::n_states] = {};
+			map<string, unit::exit_stats>  exits;
+			bool                           scheduled      = false;
+			unit::schedule_stats           sched_stats    = {};
+			unit::health_stats             health         = {};
+			map<string, unit::socket_t>    sockets;
+		};
+
+		static char**             argv;
+		static bool               requested;
+		static bool               deferred;
+		static map<string, saved> pending;
+
+		static bool quiescent(string& why);
+		static void exec     (void);
+};
+
+class metrics {
+	public:
+		static void write(void);
+
+	private:
+		static string render(void);
+		static string render_timing(void);
+		static string render_usage (shared_ptr<unit> u);
+		static string escape(const string& s);
+		static void   replace(const path& p, const string& content);
+};
+
+class trace {
+	public:
+		static void open (const path& p);
+		static bool enabled(void) { return fd != -1; }
+		static void flush(void);
+
+		static void span   (const string& u, const string& script, pid_t pid, uint64_t begin, uint64_t end, int status);
+		static void state  (const string& u, unit::state_t from, unit::state_t to);
+		static void queue  (const string& queue, const string& u, bool keep, const string& reason);
+		static void counter(const string& name, size_t value);
+
+	private:
+		static int    fd;
+		static pid_t  owner;
+		static string buf;
+		static bool   first;
+		static map<string, int> pids;
+
+		static void   adopt (int fd, const map<string, int>& pids);
+		static int    pid_of(const string& u);
+		static string ts    (uint64_t t);
+		static string us    (uint64_t ns);
+		static string str   (const string& s);
+		static void   emit  (const string& ev);
+		static void   close (void);
+
+		friend class reexec;
+};
+
+class cgroup {
+	public:
+		static void init   (const path& root);
+		static bool enabled(void);
+		static path dir    (const string& u);
+
+		static void setup (shared_ptr<unit> u);
+		static void enter (const string& u, const string& script);
+		static void signal(const string& u, const string& script, int signo);
+		static void remove(const string& u);
+
+		static bool     populated(const string& u);
+		static uint64_t memory   (const string& u);
+		static uint64_t cpu_usec (const string& u);
+
+	private:
+		static path              root;
+		static map<string, bool> populated_;
+		static map<string, int>  events_fd;
+
+		static void collect(const path& d, set<pid_t>& pids);
+		static bool write  (const path& p, const string& s);
+
+		friend class cgroup_handler;
+};
+
+class pressure {
+	public:
+		static void configure(void);
+		static bool throttled(void);
+		static bool admit    (shared_ptr<unit> u, size_t starting, reason_t* reason = 0);
+
+		static void fired(const string& resource, uint64_t window);
+
+		static const map<string, uint64_t>& events  (void);
+		static const map<string, uint64_t>& deferred(void);
+
+	private:
+		static string                config;
+		static vector<int>           fds;
+		static map<string, timer_id> active;
+		static map<string, uint64_t> events_;
+		static map<string, uint64_t> deferred_;
+		static set<string>           deferred_now;
+
+		static void eased      (const string& resource);
+		static void write_state(void);
+};
+
+class flightrec {
+	public:
+		static void state (shared_ptr<unit> u, unit::state_t from, unit::state_t to);
+		static void queue (shared_ptr<unit> u, int queue, bool keep, const reason_t& reason);
+		static void spawn (shared_ptr<unit> u, const string& script, pid_t pid);
+		static void exit  (shared_ptr<unit> u, const string& script, pid_t pid, int status);
+		static void signal(int signo);
+
+		static void dump(void);
+
+	private:
+		static const size_t size = 8192;
+		static flightrec_record ring[size];
+		static uint64_t         count;
+		static vector<string>   names;
+		static map<string, uint32_t> ids;
+
+		static flightrec_record& next(uint8_t type, shared_ptr<unit> u);
+		static uint32_t          id  (shared_ptr<unit> u);
+};
+
 class log {
 	public:
 		static bool verbose;
-		static void debug(string s);
-		static void note (string s);
-		static void warn (string s);
-		static void err  (string s);
-		static void fatal(string s);
+		static void debug(const string& s);
+		static void note (const string& s);
+		static void warn (const string& s);
+		static void err  (const string& s);
+		static void fatal(const string& s);
+
+		static void flush (void);
+		static void forked(void);
+
+	private:
+		static void write(const string& s);
+		static void drain(void);
+		static void writer(void);
 };
 
+// Only evaluates the message if verbose logging is enabled; building with WSUNITD_NO_DEBUG removes debug logging
+// entirely.
+#ifdef WSUNITD_NO_DEBUG
+	#define LOG_DEBUG(...) do {} while (0)
+#else
+	#define LOG_DEBUG(...) do { if (log::verbose) log::debug(__VA_ARGS__); } while (0)
+#endif
+
 template <class T, class F, class R> R with_weak_ptr(const weak_ptr<T>& wp, R def, F fn) {
 	shared_ptr<T> sp = wp.lock();
 	if (!sp) return def;
@@ -174,14 +588,31 @@ template <class C, class Fn> void filter(C& cont, Fn f) {
 }
 
 string signal_string(int signum);
+uint64_t monotime(void);
 
 typedef void (*term_handler)(pid_t, shared_ptr<unit>, int);
-void term_add(pid_t pid, term_handler h, shared_ptr<unit> u);
-void term_handle(pid_t pid, int status);
+void term_add(pid_t pid, term_handler h, shared_ptr<unit> u, const string& script);
+void term_handle(pid_t pid, int status, const struct rusage& ru);
 
 pid_t fork_(void);
 void output_logfile(const string name);
 
+// Time and child processes as seen by the scheduler. wsunitd runs on the system; wsunitd-sim installs a virtual clock
+// and modeled scripts instead (see sim.cpp). `fork` never returns 0 outside the system backend, so the child side of
+// the fork_ call sites only ever runs in real processes.
+class backend {
+	public:
+		virtual ~backend(void) {}
+
+		virtual uint64_t now    (void) = 0;
+		virtual pid_t    fork   (void) = 0;
+		virtual void     spawned(pid_t pid, shared_ptr<unit> u, const string& script) = 0;
+		virtual int      kill   (pid_t pid, int signo) = 0;
+		virtual void     reap   (void) = 0;
+
+		static backend* current;
+};
+
 bool status_ok(shared_ptr<unit> u, const string scriptname, int status);
 
 void mkdirs(void);
@@ -189,12 +620,48 @@ void mkdirs(void);
 class epoll_handler {
 	public:
 		virtual void handle(void) = 0;
-		virtual ~epoll_handler(void) { close(fd); }
+		virtual ~epoll_handler(void) { if (fd != -1) close(fd); }
 
 		int getfd(void) { return fd; }
 
 	protected:
-		int fd;
+		int fd = -1;
+};
+
+shared_ptr<probe> make_probe(const string& spec, uint64_t interval, function<void(bool ok, const string& why)> done);
+void              run_probe (shared_ptr<probe> pr);
+
+void epoll_add(shared_ptr<epoll_handler> h, uint32_t events = EPOLLIN);
+bool epoll_mod(int fd, uint32_t events);
+void epoll_del(int fd);
+
+class timer {
+	public:
+		static timer_id add   (uint64_t delay, function<void(void)> fn);
+		static void     cancel(timer_id id);
+		static uint64_t left  (timer_id id); // ns until the timer expires, 0 if it is not pending
+
+		static void     expire(void);
+		static uint64_t next  (void); // time of the earliest pending slot, 0 if none
+
+	private:
+		static const uint64_t tick  = 10000000; // ns
+		static const uint64_t slots = 512;
+
+		struct entry {
+			timer_id             id;
+			uint64_t             expires; // in ticks
+			function<void(void)> fn;
+		};
+
+		static int      fd;
+		static timer_id last_id;
+		static uint64_t current;
+		static uint64_t armed;
+		static list<entry> wheel[slots];
+		static unordered_map<timer_id, list<entry>::iterator> index;
+
+		static void arm(uint64_t expires);
 };
 
 void main_loop(void);